@@ -32,6 +32,8 @@
 * to force an error if LOADER_SIZE is exceeded, so if you get an "out of rom" error you will need to increase the
 * LOADER_SIZE variable to the next larger integer multiple of 256. If the loader size or total program memory
 * values are changed, they need to be changed in both bloader.c and bootapp.h, and both files must match.
+* The optional commands selected with the WITH_ defines below are off by default, as the loader does not fit in
+* 1024 words with them. Turning them on needs LOADER_SIZE raised as above, and APP_ENTRY in bootapp.h to match.
 *
 * bloader runs first at boot time, and checks to see if there is a valid application (app.) loaded in the application area.
 * If there is, then control is transferred to the app. If not, then control will remain with the boot loader.
@@ -49,6 +51,100 @@
 * Please note that the BC query command resets the sequence number to 0 so the next command sent should use sequence number 0.
 * If there is a problem with the BC_QUERY command packet, NAK will be sent.
 *
+* Protocol 1 adds windowed writes. The query response reports the number of rows the loader can buffer (window).
+* The PC sends up to that many BC_WRITE_PMW packets back to back without waiting for a response, and ends the window with
+* BC_WRITE_PMWA. Rows are buffered as long as their sequence numbers are consecutive. On BC_WRITE_PMWA the buffered rows are
+* programmed, and a cumulative ACK is sent: ACK followed by the 16 bit sequence number of the last row committed (low byte first).
+* Rows after a gap are discarded, and the PC restarts the next window at the first unacknowledged row.
+*
+* The query response also carries capability flags for optional commands. BC_ERASE_PM (CAP_ERASE) erases a range of
+* app rows starting at the word address in param. The number of rows is in the first payload word. Erased rows read
+* back as 0x3FFF, the same as the fill pattern pcl uses, so the PC only has to send the rows which are not blank.
+* BC_ROW_CRC (CAP_ROW_CRC) returns a packet with the CRC of each row starting at param. The number of rows is in the first
+* payload byte, and up to 32 CRCs are returned in the payload. The PC compares these against its image and only sends
+* the rows which differ.
+* BC_CHECK_CRC (CAP_CHECK_CRC) is BC_CHECK_APP which also requires the stored app CRC to match param. The PC uses it to
+* make sure a delta package is only applied on top of the image it was made from.
+* BC_WRITE_PMZ (CAP_RLE) writes one or more consecutive rows starting at param from a run length coded payload.
+* The number of rows is in the first payload byte, followed by a stream of tokens. A token byte with bit 7 set is a run,
+* followed by one word (low byte first) which is repeated (token & 0x7F) + 1 times. A token byte with bit 7 clear is
+* followed by token + 1 literal words. Runs and literals may cross row boundaries. The stream is checked before anything
+* is programmed, and must expand to exactly the number of rows given. BC_WRITE_PMZ is acknowledged like BC_WRITE_PM.
+* BC_COPY_PM (CAP_COPY) copies rows of program memory which are already on the target. The payload holds param pairs of
+* destination and source word addresses (low byte first). The destination must be the start of a row, the source can be
+* any word address in app space. The pairs are checked, then carried out in order, each source being read before its
+* destination is programmed. The PC uses this to move code which the linker shifted, instead of sending it again.
+* BC_SET_BAUD (CAP_BAUD) switches the UART to one of the baud rates listed in the query response (bauds, in units of
+* 100 baud, zero terminated, the first one is the power up rate). param is the index into the list. The loader ACKs
+* at the old rate, then switches. If no valid packet arrives at the new rate within about one second, the loader falls
+* back to the power up rate. The PC re-syncs with BC_QUERY at the new rate, and falls back too if that fails.
+*
+* The query response also reports the geometry of the part: the flash row size in words (rowwords), the maximum number
+* of rows in one packet (maxrows) and the size of the data EEPROM in bytes (eesize). From protocol 2, BC_WRITE_PM,
+* BC_WRITE_PMW, BC_WRITE_PMWA and BC_WRITE_EEPROM packets may carry up to maxrows consecutive rows. The extra rows follow the first one in the payload,
+* and the pad and CRC move back by LOADER_PAYLOAD bytes for each extra row. The sequence number counts packets, not rows.
+* All other packets, and every packet sent by the loader, stay single row. The param of BC_WRITE_EEPROM is then the
+* byte address of the row. pcl keeps sending earlier loaders single row packets, and EEPROM addresses as it did before.
+*
+* Protocol 3 adds COBS framing. Byte stuffing doubles every byte <= SUBST, which includes the high byte of most
+* program words. A COBS frame starts and ends with a zero byte. In between, the packet is split at each zero byte,
+* and each piece is sent as a code byte (its length + 1) followed by its bytes, the zero being implied. Only a code
+* byte of 0xFF (254 non zero bytes) has no zero after it. Back to back zero bytes count as one delimiter, so a loader
+* which starts listening mid frame, or loses a byte, is back in step at the next frame. The loader accepts both
+* framings at all times and replies in the framing of the packet it received. The PC sends BC_QUERY byte stuffed, and
+* switches to COBS when the response reports protocol 3 or later. Single byte responses such as ACK and NAK are not
+* framed.
+*
+* BC_WRITE_PMP, BC_WRITE_PMWP and BC_WRITE_PMWPA (CAP_PACK) are BC_WRITE_PM, BC_WRITE_PMW and BC_WRITE_PMWA with the
+* rows packed 14 bits per word, as the top two bits of a program word are always clear. Each group of 4 words takes
+* 7 bytes, least significant bits first, so a row takes PACKED_ROW (56) bytes instead of 64 and the packet shrinks
+* by 8 bytes per row. Packed and unpacked packets can be mixed in a window.
+*
+* Protocol 4 adds short packets, which leave out the unused payload and the pad. A short packet has the packet type
+* HDS instead of HDC, and a payload length byte after the sequence number. The payload follows, then the CRC of
+* everything before it. A short payload of up to one row is zero filled by the loader, so the PC can also leave out
+* trailing zeros. Longer payloads must hold whole rows. The loader replies with a short packet if it got one. The PC
+* sends BC_QUERY as a full packet, and switches to short packets when the response reports protocol 4 or later.
+*
+* CAP_COMPOUND commands fold the usual command pairs into one round trip. BC_QUERY with the QO_WRITE_EN option also
+* enables writes, so BC_WRITE_EN can be left out. BC_WRITE_PMC is BC_WRITE_PM followed by BC_CHECK_APP, the PC sends
+* the last row of the image with it and gets STX back if the app does not check out. BC_CHECK_EXEC is BC_CHECK_APP
+* followed by BC_EXEC_APP. It ACKs and starts the app if the check passes, otherwise it replies STX and stays put.
+*
+* The query response also carries a second capability byte, caps2. With CAP2_FEC, packets from the PC may have
+* FEC_BYTES check bytes after the CRC. Such a packet has the packet type HDCF or HDSF in place of HDC or HDS, and the
+* CRC covers the type as sent. Byte i of the packet (CRC included) is in codeword w = i % FEC_WAYS, which starts with
+* check bytes 2w and 2w + 1. Over GF(256) with the polynomial 0x11D, the check bytes make the sum of the codeword
+* bytes zero, and also the sum of each byte times x to the power of its position in the codeword. The loader can then
+* put one bad byte right in each codeword, so a burst of up to FEC_WAYS bytes can be corrected. Only packets of the
+* FEC types are corrected, so each packet says for itself and no mode needs to be set. Framing bytes and packets from
+* the loader are not covered. pcl sends check bytes if fec is set in pcl.conf.
+*
+* CAP2_INTERLEAVE lets the PC program several nodes on one bus at once. BC_WRITE_PMWC and BC_WRITE_PMWPC end a window
+* like BC_WRITE_PMWA and BC_WRITE_PMWPA, but the loader programs the rows without responding. While it does, the PC sends
+* other nodes their windows. The PC then asks for the cumulative ACK with BC_POLL, which is answered like the end of
+* a window, without programming anything. The loader may miss bytes of packets to other nodes while it programs.
+* That does no harm, as it picks up the framing again at the next frame: a byte stuffed frame starts with STX, and
+* back to back COBS delimiters count as one.
+*
+* CAP2_BROADCAST lets the PC send an image once to every node of a product. BC_WRITE_PMB and BC_WRITE_PMBP are sent to
+* BROADCAST_ADDR, with PRODUCTID in place of the sequence number. A node with writes enabled programs the rows, does not
+* respond and leaves its sequence number alone. The PC waits for the rows to be programmed before it sends the next
+* packet, then reads the row CRCs of each node in turn and rewrites the rows which did not make it.
+*
+* CAP2_ADDRU is for parts with more than 64K words of program memory. The query response then carries bits 16-23
+* of the app size in appsizeu, and BC_SET_ADDRU sets bits 16-23 of the word addresses in the commands which follow,
+* until the next BC_QUERY. The PC only sends it when a row above 64K words is next, and does not let a packet, window
+* or run length coded group cross a 64K word boundary. The parts supported here have less than 64K words, so the
+* loader only accepts 0.
+*
+* The BC_QUERY param carries option bits (QO_*) in its low byte when its high byte is QUERY_OPTS, else it is ignored.
+*
+* Protocol 5 adds NAK reasons. If the query sets QO_NAK_REASON, every NAK is followed by a reason code (NR_*) and the
+* sequence number the loader expects next, low byte first. Packets which fail the CRC or length checks are then NAKed
+* with NR_CRC or NR_LENGTH instead of being ignored, as long as the header still carries our address. BC_WRITE_PMW
+* and BC_WRITE_PMWP are never NAKed. The PC resends straight away after NR_CRC or NR_LENGTH, takes NR_SEQ with the
+* next sequence number as an ACK which was lost, and gives up on the other reasons, as a resend would fail again.
 *
 */
 
@@ -64,6 +160,18 @@
 //#define FORCE_ERR			// Test error recovery
 #define	WITH_LED			// Allow LED usage
 #define WITH_BUTTON			// Allow button usage
+//#define WITH_WINDOW			// Allow windowed writes (uses WINDOW_ROWS * LOADER_PAYLOAD bytes of RAM)
+//#define WITH_ERASE			// Allow range erase of program memory
+//#define WITH_ROW_CRC			// Allow reading back row CRCs
+//#define WITH_CHECK_CRC			// Allow checking the app CRC against the one the PC expects
+//#define WITH_RLE			// Allow run length coded row writes
+//#define WITH_COPY			// Allow copying rows already on the target
+//#define WITH_PACK			// Allow 14 bit packed row writes
+//#define WITH_COMPOUND			// Allow commands which save a round trip
+//#define WITH_FEC			// Allow forward error correction on packets from the PC
+//#define WITH_INTERLEAVE			// Allow programming several nodes at once (needs WITH_WINDOW)
+//#define WITH_BROADCAST			// Allow writes broadcast to every node of this product
+//#define WITH_BAUD			// Allow the PC to switch to a faster baud rate (uses timer 1)
 
 /*
 * Leave these alone unless you know what you are doing
@@ -83,7 +191,7 @@
 #pragma fuses HS, PLL, WDT, PUT, NOLVP
 // Clock speed
 #pragma use delay(internal=32Mhz, restart_wdt)
-// RS-232 baud rate
+// RS-232 baud rate at power up, see set_baud() for the others
 #pragma use rs232(baud=9600, UART1, ERRORS, RESTART_WDT)
 
 #define TOTAL_PROGRAM_MEMORY getenv("PROGRAM_MEMORY")		// Number of words of program memory PIC16F1938
@@ -92,7 +200,7 @@
 // Set these to indicate different versions and protocol changes to the PC loader app (pcl).
 #define PRODUCTID	0x3FFF			// Product ID (unique for each product). Do not use the default 0x3FFF as that is reserved for testing.
 #define BOOTVERSION	0			// Boot loader version (change when additional functionallity is added to boot loader, and pcl needs to know about it)
-#define PROTOCOL	0			// Protocol in use (change when boot loader expects a deviation in the protocol different from what
+#define PROTOCOL	5			// Protocol in use (change when boot loader expects a deviation in the protocol different from what
 						// is documented here and pcl needs to know about it)
 
 // Initial states for I/O pins. Set these to suit your app.
@@ -126,8 +234,16 @@
 #define CONFIG_BLOCK_SIZE 16			// Number of words of config memory to transfer
 #define LOADER_START	0			// Loader starts at byte 0	
 #define LOADER_LASTADDR	(LOADER_SIZE - 1)	// Last byte address of loader	
-#define LOADER_BUFSIZE	80			// Buffer size in bytes for getting data from PC
 #define LOADER_PAYLOAD	64			// Loader payload in Bytes
+#define PACKET_ROWS	2			// Max rows in one write packet
+#ifdef WITH_FEC
+#define FEC_WAYS	4			// Interleaved FEC codewords per packet, one byte error can be corrected in each
+#define FEC_BYTES	(FEC_WAYS * 2)		// FEC check bytes after the CRC
+#else
+#define FEC_BYTES	0
+#endif
+#define LOADER_BUFSIZE	(80 + ((PACKET_ROWS - 1) * LOADER_PAYLOAD) + FEC_BYTES) // Buffer size in bytes for getting data from PC
+#define WINDOW_ROWS	4			// Number of rows buffered in windowed write mode
 #define APP_START	LOADER_SIZE
 #define APP_ENTRY	LOADER_SIZE
 #define APP_ISR_ENTRY	LOADER_SIZE + 4
@@ -137,10 +253,29 @@
 
 #define BC_QUERY	0x00			// Query command
 #define BC_CHECK_APP	0x08			// Check app space for integrity
+#define BC_CHECK_CRC	0x09			// Check app space for integrity, and that the app CRC matches param
+#define BC_ROW_CRC	0x0A			// Return the CRCs of a range of program memory rows
+#define BC_POLL		0x0B			// Return a cumulative ACK for the packets committed so far
 #define BC_WRITE_EN	0x10			// Write enable
+#define BC_SET_BAUD	0x11			// Switch to the baud rate at index param in the baud rate list
+#define BC_SET_ADDRU	0x12			// Set bits 16-23 of the word address of the commands which follow
+#define BC_ERASE_PM	0x20			// Erase a range of program memory rows
+#define BC_COPY_PM	0x21			// Copy program memory rows on the target
 #define BC_WRITE_PM	0x40			// Write program memory
+#define BC_WRITE_PMW	0x41			// Write program memory, windowed, no response
+#define BC_WRITE_PMWA	0x42			// Write program memory, windowed, commit rows and send cumulative ACK
+#define BC_WRITE_PMZ	0x43			// Write program memory, run length coded rows
+#define BC_WRITE_PMP	0x44			// BC_WRITE_PM with 14 bit packed rows
+#define BC_WRITE_PMWP	0x45			// BC_WRITE_PMW with 14 bit packed rows
+#define BC_WRITE_PMWPA	0x46			// BC_WRITE_PMWA with 14 bit packed rows
+#define BC_WRITE_PMC	0x47			// BC_WRITE_PM, then BC_CHECK_APP
+#define BC_WRITE_PMWC	0x48			// BC_WRITE_PMWA without the response
+#define BC_WRITE_PMWPC	0x49			// BC_WRITE_PMWC with 14 bit packed rows
+#define BC_WRITE_PMB	0x4A			// Write program memory on every node of the product ID in seq, no response
+#define BC_WRITE_PMBP	0x4B			// BC_WRITE_PMB with 14 bit packed rows
 #define BC_WRITE_EEPROM	0xA5			// Write config memory
 #define BC_EXEC_APP	0x55			// Execute APP
+#define BC_CHECK_EXEC	0x56			// BC_CHECK_APP, then BC_EXEC_APP if good
 #define BC_RESET	0xAA			// Reset CPU
 
 
@@ -163,12 +298,57 @@
 #define STX 		0x02
 #define ETX		0x03
 #define SUBST		0x04
+#define ENQ		0x05
+#define SO		0x0E
 #define	HDC		0xFF	
+#define	HDS		0xFE			// Short packet type
+#define	HDCF		0xFD			// Full packet with FEC check bytes
+#define	HDSF		0xFC			// Short packet with FEC check bytes
+#define BROADCAST_ADDR	0xFF			// Address of broadcast writes, no node has it as an erased EEPROM gives 0x1F
 #define ACK		0xC1
 #define NAK 		0x81
 
 #define MAX_CF 32
 
+// Capability flags in the query response
+
+#define CAP_ERASE	0x01			// BC_ERASE_PM supported
+#define CAP_ROW_CRC	0x02			// BC_ROW_CRC supported
+#define CAP_CHECK_CRC	0x04			// BC_CHECK_CRC supported
+#define CAP_RLE		0x08			// BC_WRITE_PMZ supported
+#define CAP_COPY	0x10			// BC_COPY_PM supported
+#define CAP_BAUD	0x20			// BC_SET_BAUD supported
+#define CAP_PACK	0x40			// BC_WRITE_PMP, BC_WRITE_PMWP and BC_WRITE_PMWPA supported
+#define CAP_COMPOUND	0x80			// QO_WRITE_EN, BC_WRITE_PMC and BC_CHECK_EXEC supported
+
+// More capability flags, in caps2
+#define CAP2_FEC	0x01			// Packets from the PC may carry FEC check bytes
+#define CAP2_INTERLEAVE	0x02			// BC_WRITE_PMWC, BC_WRITE_PMWPC and BC_POLL supported
+#define CAP2_BROADCAST	0x04			// BC_WRITE_PMB and BC_WRITE_PMBP supported
+#define CAP2_ADDRU	0x08			// BC_SET_ADDRU supported, and appsizeu reported
+
+#define QUERY_OPTS	0xA500			// High byte of a BC_QUERY param which carries option bits in the low byte
+#define QO_WRITE_EN	0x01			// Also enable writes (CAP_COMPOUND)
+#define QO_NAK_REASON	0x02			// Follow each NAK with a reason code and the expected sequence number
+
+// NAK reason codes
+#define NR_CRC		0x01			// Bad CRC
+#define NR_LENGTH	0x02			// Bad packet length
+#define NR_SEQ		0x03			// Sequence number is not the one expected
+#define NR_WRITE_EN	0x04			// Writes not enabled
+#define NR_RANGE	0x05			// Address, count or payload out of range
+#define NR_CMD		0x06			// Unknown command
+
+#define MAX_BAUDS	8			// Size of the baud rate list in the query response
+#define NUM_BAUDS	5			// Baud rates offered, must match set_baud()
+#define BAUD_TIMEOUT	16			// Timer 1 overflows (65.5ms each) to wait for a valid packet after a baud rate change
+
+#define RLE_RUN		0x80			// Token is a run of one word
+#define PACKED_ROW	((LOADER_PAYLOAD >> 3) * 7)	// Bytes in a 14 bit packed row, 4 words in 7 bytes
+#define PACKET_OVERHEAD	(sizeof(ps_t) - LOADER_PAYLOAD) // Header, pad and CRC bytes in a packet
+#define SHORT_LEN	7			// Offset of the payload length in a short packet
+#define SHORT_OVERHEAD	10			// Header, length and CRC bytes in a short packet
+
 
 typedef struct {
 	u16 lsize;
@@ -177,6 +357,14 @@ typedef struct {
 	u8  bootvers;
 	u8  proto;
 	u8  config[MAX_CF];
+	u8  window;
+	u8  caps;
+	u16 bauds[MAX_BAUDS];
+	u8  rowwords;
+	u8  maxrows;
+	u16 eesize;
+	u8  caps2;
+	u8  appsizeu;			// Bits 16-23 of appsize, always 0 as these parts have less than 64K words
 } response_t;
 
 typedef union	{
@@ -225,6 +413,25 @@ typedef union {
 
 packet_t pkt;
 static u8 cmd, myaddress;
+static u16 seqno;
+static u1 cobs;					// Last packet was COBS framed
+static u1 shortpkt;				// Last packet was a short packet
+static u1 naks;					// Send NAK reason codes
+static u8 nakreason;				// Reason for the last NAK
+static u8 rowbuf[LOADER_PAYLOAD];		// Scratch buffer for one row of program memory
+
+#ifdef WITH_WINDOW
+static u8 wbuf[WINDOW_ROWS][LOADER_PAYLOAD];	// Rows received in the current window
+static u16 waddr[WINDOW_ROWS];			// Word addresses of the above
+static u8 wcount;				// Number of rows in the window
+static u8 wpkts;				// Number of packets in the window
+#endif
+
+#ifdef WITH_BAUD
+const u16 baud_list[NUM_BAUDS] = {96, 576, 1152, 2500, 5000}; // In units of 100 baud
+static u8 newbaud;				// Baud rate index + 1 to switch to once the ACK has been sent
+static u8 baud_ticks;				// Timer 1 overflows left before falling back to the power up rate
+#endif
 
 
 // Default product ID at top of boot loader image
@@ -347,6 +554,52 @@ static void tx_wait_empty()
 
 
 
+// Calculate the CRC for the packet buffer and send it
+
+void send_packet(u8 plen)
+{
+	u8 i, n, len;
+	u16 crc16;
+
+	len = sizeof(ps_t);
+	if(shortpkt){ // Reply with a short packet if the PC sent one
+		for(i = plen; i; i--) // Make room for the length
+			pkt.buffer[SHORT_LEN + i] = pkt.buffer[SHORT_LEN + i - 1];
+		pkt.s.pkttype = HDS;
+		pkt.buffer[SHORT_LEN] = plen;
+		len = SHORT_OVERHEAD + plen;
+	}
+	crc16 = do_crc(0, pkt.buffer, len - sizeof(u16));
+	pkt.buffer[len - 2] = make8(crc16, 0);
+	pkt.buffer[len - 1] = make8(crc16, 1);
+
+	if(cobs){ // Reply in the framing the PC used
+		putc(NUL);
+		for(i = 0;;){
+			for(n = i; (n != len) && (pkt.buffer[n]); n++)
+				;
+			putc(n - i + 1);
+			for(; i != n; i++)
+				putc(pkt.buffer[i]);
+			if(n == len)
+				break;
+			i++; // Zero implied by the code byte
+		}
+		putc(NUL);
+		return;
+	}
+
+	putc(STX);
+	// Send packet
+	for( i = 0 ; i < len ; i++){
+		if(pkt.buffer[i] <= SUBST)
+			putc(SUBST);
+		putc(pkt.buffer[i]);
+	}
+	putc(ETX);
+}
+
+
 // Send query response packet
 
 void send_query_response(void)
@@ -355,7 +608,7 @@ void send_query_response(void)
 	u8 i;
 	u16 v;
 
-	for(i = 0; i < sizeof(packet_t); i++) // Zero out packet buffer
+	for(i = 0; i < sizeof(ps_t); i++) // Zero out packet buffer
 		pkt.buffer[i] = 0;
 
 	// Build the response packet
@@ -364,23 +617,197 @@ void send_query_response(void)
 	pkt.s.pl.resp.prodid = PRODUCTID;
 	pkt.s.pl.resp.bootvers = BOOTVERSION;
 	pkt.s.pl.resp.proto = PROTOCOL;
+	pkt.s.pl.resp.rowwords = (LOADER_PAYLOAD >> 1);
+	pkt.s.pl.resp.maxrows = PACKET_ROWS;
+	pkt.s.pl.resp.eesize = getenv("DATA_EEPROM");
+	#ifdef WITH_WINDOW
+	pkt.s.pl.resp.window = WINDOW_ROWS;
+	#endif
+	#ifdef WITH_ERASE
+	pkt.s.pl.resp.caps |= CAP_ERASE;
+	#endif
+	#ifdef WITH_ROW_CRC
+	pkt.s.pl.resp.caps |= CAP_ROW_CRC;
+	#endif
+	#ifdef WITH_CHECK_CRC
+	pkt.s.pl.resp.caps |= CAP_CHECK_CRC;
+	#endif
+	#ifdef WITH_RLE
+	pkt.s.pl.resp.caps |= CAP_RLE;
+	#endif
+	#ifdef WITH_COPY
+	pkt.s.pl.resp.caps |= CAP_COPY;
+	#endif
+	#ifdef WITH_PACK
+	pkt.s.pl.resp.caps |= CAP_PACK;
+	#endif
+	#ifdef WITH_COMPOUND
+	pkt.s.pl.resp.caps |= CAP_COMPOUND;
+	#endif
+	#ifdef WITH_FEC
+	pkt.s.pl.resp.caps2 |= CAP2_FEC;
+	#endif
+	#ifdef WITH_INTERLEAVE
+	pkt.s.pl.resp.caps2 |= CAP2_INTERLEAVE;
+	#endif
+	#ifdef WITH_BROADCAST
+	pkt.s.pl.resp.caps2 |= CAP2_BROADCAST;
+	#endif
+	pkt.s.pl.resp.caps2 |= CAP2_ADDRU;
+	#ifdef WITH_BAUD
+	pkt.s.pl.resp.caps |= CAP_BAUD;
+	for(i = 0 ; i < NUM_BAUDS ; i++)
+		pkt.s.pl.resp.bauds[i] = baud_list[i];
+	#endif
 	for(i = 0, q = &pkt.s.pl.resp.config ; i < CONFIG_BLOCK_SIZE ; i++){
 		v = read_configmem_word(i);
 		*q++ = make8(v, 0);
 		*q++ = make8(v, 1);
 	}
-	// Calculate CRC for above
-	pkt.s.crc16 = do_crc(0, pkt.buffer, sizeof(packet_t) - sizeof(u16));
+	send_packet(sizeof(response_t));
+}
 
-	putc(STX);
-	// Send packet
-	for( i = 0 ; i < sizeof(packet_t) ; i++){
-		if(pkt.buffer[i] <= SUBST)
-			putc(SUBST);
-		putc(pkt.buffer[i]);
+#ifdef WITH_ROW_CRC
+
+// Send a packet with the CRCs of the rows requested with BC_ROW_CRC
+
+void send_row_crcs(void)
+{
+	u8 i, count;
+	u16 pmaddr, crc16;
+
+	pmaddr = pkt.s.param;
+	count = pkt.s.pl.payload[0];
+
+	for(i = 0; i < sizeof(ps_t); i++) // Zero out packet buffer
+		pkt.buffer[i] = 0;
+
+	pkt.s.cmd = BC_ROW_CRC;
+	pkt.s.param = pmaddr;
+	for(i = 0; i < count; i++){
+		read_program_memory(pmaddr, rowbuf, LOADER_PAYLOAD);
+		crc16 = do_crc(0, rowbuf, LOADER_PAYLOAD);
+		pkt.s.pl.payload[i << 1] = make8(crc16, 0);
+		pkt.s.pl.payload[(i << 1) + 1] = make8(crc16, 1);
+		pmaddr += (LOADER_PAYLOAD >> 1);
 	}
-	putc(ETX);
+	send_packet(count << 1);
 }
+#endif
+
+
+#ifdef WITH_RLE
+
+// Expand the run length coded rows in the payload of a BC_WRITE_PMZ packet.
+// With program clear the stream is only checked. Returns 1 if the stream is bad.
+
+bool expand_rows(u16 pmaddr, u8 nrows, u1 program)
+{
+	u8 i, w, t, count;
+
+	w = 0;
+	for(i = 1; nrows; ){ // Row count is in payload[0]
+		if(i >= LOADER_PAYLOAD)
+			return 1; // Stream too short
+		t = pkt.s.pl.payload[i++];
+		for(count = (t & ~RLE_RUN) + 1; count; count--){
+			if((!nrows) || (i > LOADER_PAYLOAD - 2))
+				return 1; // Too many words, or stream too short
+			rowbuf[w++] = pkt.s.pl.payload[i];
+			rowbuf[w++] = pkt.s.pl.payload[i + 1];
+			if(!(t & RLE_RUN))
+				i += 2;
+			if(w == LOADER_PAYLOAD){
+				if(program)
+					write_program_memory(pmaddr, rowbuf, LOADER_PAYLOAD);
+				pmaddr += (LOADER_PAYLOAD >> 1);
+				w = 0;
+				nrows--;
+				restart_wdt();
+			}
+		}
+		if(t & RLE_RUN)
+			i += 2;
+	}
+	return 0;
+}
+#endif
+
+
+#ifdef WITH_COPY
+
+// Copy the rows in the payload of a BC_COPY_PM packet.
+// With program clear the address pairs are only checked. Returns 1 if an address is bad.
+
+bool copy_rows(u8 count, u1 program)
+{
+	u8 i;
+	u16 dst, src;
+
+	for(i = 0; i < (count << 2); i += 4){
+		dst = make16(pkt.s.pl.payload[i + 1], pkt.s.pl.payload[i]);
+		src = make16(pkt.s.pl.payload[i + 3], pkt.s.pl.payload[i + 2]);
+		if((dst < APP_START) || (dst >= TOTAL_PROGRAM_MEMORY) || (dst & ((LOADER_PAYLOAD >> 1) - 1)) ||
+		(src < APP_START) || (src > TOTAL_PROGRAM_MEMORY - (LOADER_PAYLOAD >> 1)))
+			return 1;
+		if(program){
+			read_program_memory(src, rowbuf, LOADER_PAYLOAD);
+			write_program_memory(dst, rowbuf, LOADER_PAYLOAD);
+			restart_wdt();
+		}
+	}
+	return 0;
+}
+#endif
+
+
+#ifdef WITH_BAUD
+
+// Switch the UART to the baud rate at index in baud_list
+
+void set_baud(u8 index)
+{
+	switch(index){
+		case 1:
+			set_uart_speed(57600);
+			break;
+
+		case 2:
+			set_uart_speed(115200);
+			break;
+
+		case 3:
+			set_uart_speed(250000);
+			break;
+
+		case 4:
+			set_uart_speed(500000);
+			break;
+
+		default:
+			set_uart_speed(9600);
+			break;
+	}
+}
+
+// Wait for a byte from the UART. After a baud rate change, fall back to the power up rate
+// if no valid packet arrives in time.
+
+u8 rx_byte(void)
+{
+	while(!kbhit()){
+		restart_wdt();
+		if(baud_ticks && interrupt_active(INT_TIMER1)){
+			clear_interrupt(INT_TIMER1);
+			if(!--baud_ticks)
+				set_baud(0);
+		}
+	}
+	return getc();
+}
+#else
+#define rx_byte() getc()
+#endif
 
 
 // Test ROM for integrity
@@ -413,37 +840,197 @@ bool check_appspace(void)
 
 }
 
+#ifdef WITH_CHECK_CRC
+// Return the app CRC stored in the top row
 
-// Process packet
+u16 app_crc(void)
+{
+	read_program_memory(TOTAL_PROGRAM_MEMORY - (LOADER_PAYLOAD >> 1) , pkt.buffer, LOADER_PAYLOAD); // Read the top row
+	return make16(pkt.buffer[CRCHI],pkt.buffer[CRCLO]);
+}
+#endif
 
-u8 process_packet(void)
+
+// Return row j of the packet payload. Packed rows are unpacked into rowbuf first,
+// every 7 bytes holding 4 words, least significant bits first.
+
+u8 *packet_row(u8 j, u1 packed)
 {
-	u8 i;
+	u8 i, *p, *q;
+
+	#ifdef WITH_PACK
+	if(packed){
+		p = pkt.s.pl.payload + (j * PACKED_ROW);
+		for(i = 0, q = rowbuf; i < (LOADER_PAYLOAD >> 3); i++, p += 7, q += 8){
+			q[0] = p[0];
+			q[1] = p[1] & 0x3F;
+			q[2] = (p[1] >> 6) | (p[2] << 2);
+			q[3] = ((p[2] >> 6) | (p[3] << 2)) & 0x3F;
+			q[4] = (p[3] >> 4) | (p[4] << 4);
+			q[5] = ((p[4] >> 4) | (p[5] << 4)) & 0x3F;
+			q[6] = (p[5] >> 2) | (p[6] << 6);
+			q[7] = p[6] >> 2;
+		}
+		return rowbuf;
+	}
+	#endif
+	return pkt.s.pl.payload + (j * LOADER_PAYLOAD);
+}
+
+
+#ifdef WITH_FEC
+// Multiply by x in GF(256), polynomial 0x11D
+
+u8 gf_xtime(u8 x)
+{
+	if(x & 0x80)
+		return (x << 1) ^ 0x1D;
+	return x << 1;
+}
+
+// Correct the first len bytes of the packet from the FEC check bytes which follow them.
+// Byte i of the packet is in codeword w = i % FEC_WAYS, which starts with check bytes 2w and 2w + 1.
+// One bad byte can be put right in each codeword, anything worse is left for the CRC check to catch.
+
+void fec_correct(u8 len)
+{
+	u8 w, i, j, n, s0, s1, t;
+	u8 *p;
+
+	for(w = 0, p = pkt.buffer + len; w < FEC_WAYS; w++, p += 2){
+		// Syndromes, s1 by Horner's rule from the last byte of the codeword down
+		n = (len - w + FEC_WAYS - 1) / FEC_WAYS;
+		s0 = 0;
+		s1 = 0;
+		for(i = n, j = w + ((n - 1) * FEC_WAYS); i; i--, j -= FEC_WAYS){
+			s0 ^= pkt.buffer[j];
+			s1 = gf_xtime(s1) ^ pkt.buffer[j];
+		}
+		s0 ^= p[0] ^ p[1];
+		s1 = gf_xtime(gf_xtime(s1) ^ p[1]) ^ p[0];
+		if((!s0) || (!s1))
+			continue; // Good, or more than one error
+		// A single error of s0 at codeword position i gives s1 = s0 * x^i
+		for(i = 0, t = s0; i < (n + 2); i++, t = gf_xtime(t)){
+			if(t == s1){
+				if(i >= 2)
+					pkt.buffer[w + ((i - 2) * FEC_WAYS)] ^= s0;
+				break;
+			}
+		}
+	}
+}
+#endif
+
+// NAK a packet which could not be processed, if the PC asked for reasons.
+// Windowed writes which do not end a window with a cumulative ACK get no response, so the bus stays free for the rest of the window.
+// Broadcast writes get none either, as every node of the product would answer at once.
+
+u8 nak_bad(u8 reason)
+{
+	if((!naks) || (pkt.s.cmd == BC_WRITE_PMW) || (pkt.s.cmd == BC_WRITE_PMWP) ||
+	(pkt.s.cmd == BC_WRITE_PMWC) || (pkt.s.cmd == BC_WRITE_PMWPC) || (pkt.s.cmd == BC_WRITE_PMB) ||
+	(pkt.s.cmd == BC_WRITE_PMBP))
+		return NUL;
+	nakreason = reason;
+	return NAK;
+}
+
+// Process packet, len is the number of bytes received
+
+u8 process_packet(u8 len)
+{
+	u8 i, j;
+	u8 prows, rowbytes, plen;
+	u8 *row;
 	u8 acknak;
 	u8 eeaddress;
 	u16 crc16;
-	static u16 seqno,pseq;
+	static u16 pseq;
 	u16 param;
+	u16 nrows;
 	static u1 write_en;
+	u1 packed;
+	#ifdef WITH_FEC
+	u1 fecpkt;
+	#endif
 
 	#ifdef FORCE_ERR
 	static int errctr; 
 	#endif
 
 	// check packet
-	crc16 = do_crc(0, pkt.buffer, sizeof(packet_t) - sizeof(u16));
-	if(crc16 != pkt.s.crc16){
+	if(len < SHORT_OVERHEAD)
+		return NUL; // runt, ignore
+	#ifdef WITH_FEC
+	// The packet type says whether FEC check bytes follow the CRC
+	fecpkt = (((pkt.s.pkttype == HDCF) || (pkt.s.pkttype == HDSF)) && (len >= (SHORT_OVERHEAD + FEC_BYTES)));
+	if(fecpkt){
+		len -= FEC_BYTES;
+		fec_correct(len);
+	}
+	#endif
+	crc16 = do_crc(0, pkt.buffer, len - sizeof(u16));
+	if(crc16 != make16(pkt.buffer[len - 1], pkt.buffer[len - 2])){
+		// Only answer if the header still looks like it is for us, other nodes share the bus
+		if(((pkt.s.pkttype == HDC) || (pkt.s.pkttype == HDS) || (pkt.s.pkttype == HDCF) || (pkt.s.pkttype == HDSF)) &&
+		(pkt.s.address == myaddress))
+			return nak_bad(NR_CRC);
 		return NUL; // no good, ignore
 	}
 
 
 	// check packet type
-	if(pkt.s.pkttype != HDC)
+	#ifdef WITH_FEC
+	if(fecpkt) // From here on it is handled like the packet without check bytes
+		pkt.s.pkttype = (pkt.s.pkttype == HDCF) ? HDC : HDS;
+	#endif
+	shortpkt = (pkt.s.pkttype == HDS);
+	if((pkt.s.pkttype != HDC) && (!shortpkt))
 		return NUL; // wrong packet type, ignore
 
 	// check packet address
+	#ifdef WITH_BROADCAST
+	// Broadcast writes are for every node of the product, whose ID they carry in place of the sequence number
+	if((pkt.s.address != myaddress) && ((pkt.s.address != BROADCAST_ADDR) || (pkt.s.seq != PRODUCTID) ||
+	((pkt.s.cmd != BC_WRITE_PMB) && (pkt.s.cmd != BC_WRITE_PMBP))))
+		return NUL; // not for us, ignore
+	#else
 	if(pkt.s.address != myaddress)
 		return NUL; // not for us, ignore
+	#endif
+
+	// Get the payload length. A short packet carries it. Its payload is moved to where it sits in a full packet,
+	// and zero filled to a whole row. A full packet is padded to a whole number of rows.
+	if(shortpkt){
+		plen = pkt.buffer[SHORT_LEN];
+		if(len != (SHORT_OVERHEAD + plen))
+			return nak_bad(NR_LENGTH); // bad length
+		for(i = 0; i < plen; i++)
+			pkt.buffer[SHORT_LEN + i] = pkt.buffer[SHORT_LEN + 1 + i];
+		for(; i < LOADER_PAYLOAD; i++)
+			pkt.buffer[SHORT_LEN + i] = 0;
+	}
+	else if(len >= PACKET_OVERHEAD)
+		plen = len - PACKET_OVERHEAD;
+	else
+		return nak_bad(NR_LENGTH); // runt
+
+	// One row, or up to PACKET_ROWS whole rows, packed rows are shorter
+	packed = 0;
+	#ifdef WITH_PACK
+	packed = ((pkt.s.cmd == BC_WRITE_PMP) || (pkt.s.cmd == BC_WRITE_PMWP) || (pkt.s.cmd == BC_WRITE_PMWPA) ||
+	(pkt.s.cmd == BC_WRITE_PMWPC) || (pkt.s.cmd == BC_WRITE_PMBP));
+	#endif
+	rowbytes = (packed) ? PACKED_ROW : LOADER_PAYLOAD;
+	prows = 1;
+	if(plen > rowbytes){
+		prows = plen / rowbytes;
+		if((prows > PACKET_ROWS) || (plen != (prows * rowbytes)))
+			return nak_bad(NR_LENGTH); // bad length
+	}
+	else if((plen != rowbytes) && (!shortpkt))
+		return nak_bad(NR_LENGTH); // full packets carry whole rows
 
 
 	pseq = pkt.s.seq;
@@ -451,10 +1038,29 @@ u8 process_packet(void)
 	cmd = pkt.s.cmd;
 	acknak = ACK;
 
+	// Reason for a NAK from the write commands, which check these first
+	if(!write_en)
+		nakreason = NR_WRITE_EN;
+	else if(seqno != pseq)
+		nakreason = NR_SEQ;
+	else
+		nakreason = NR_RANGE;
+
+	#ifdef WITH_BAUD
+	baud_ticks = 0; // Valid packet, keep the current baud rate
+	#endif
+
 	switch(cmd){
 		case	BC_QUERY:
 			seqno = 0; // Zero out sequence number when we get this command. This provides a way to sync.
 			write_en = 0;
+			naks = 0;
+			if((param & 0xFF00) == QUERY_OPTS){ // Options from the PC
+				naks = (param & QO_NAK_REASON) ? 1 : 0;
+				#ifdef WITH_COMPOUND
+				write_en = (param & QO_WRITE_EN) ? 1 : 0; // Query and write enable in one round trip
+				#endif
+			}
 			#ifdef FORCE_ERR
 			errctr = 11; // Force an error on the tenth block. 
 			#endif
@@ -465,7 +1071,31 @@ u8 process_packet(void)
 			write_en = 1;
 			break;
 
+		#ifdef WITH_BAUD
+		case	BC_SET_BAUD: // Switch baud rate once the ACK has been sent
+			if(param < NUM_BAUDS)
+				newbaud = (u8) param + 1;
+			else{
+				acknak = NAK;
+				nakreason = NR_RANGE;
+			}
+			break;
+		#endif
+
+		case	BC_SET_ADDRU: // Program memory ends below 64K words, so only the first 64K words can be selected
+			if(param){
+				acknak = NAK;
+				nakreason = NR_RANGE;
+			}
+			break;
+
 		case	BC_WRITE_PM:
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMP:
+		#endif
+		#ifdef WITH_COMPOUND
+		case	BC_WRITE_PMC:
+		#endif
 
 			#ifdef FORCE_ERR
 			if(errctr == 1){ // Force an error 
@@ -479,17 +1109,127 @@ u8 process_packet(void)
 			#endif
 
 			if((write_en) && (seqno == pseq) && (param >= APP_START)){
-				write_program_memory(param, pkt.s.pl.payload, LOADER_PAYLOAD);
+				for(j = 0; j < prows; j++){
+					write_program_memory(param, packet_row(j, packed), LOADER_PAYLOAD);
+					param += (LOADER_PAYLOAD >> 1);
+				}
+			}
+			else
+				acknak = NAK;
+			#ifdef WITH_COMPOUND
+			if((cmd == BC_WRITE_PMC) && (acknak == ACK) && check_appspace())
+				acknak = STX; // Row written, but the app does not check out
+			#endif
+			break;
+
+		#ifdef WITH_RLE
+		case	BC_WRITE_PMZ: // Write the number of rows in the first payload byte, starting at param
+			nrows = pkt.s.pl.payload[0];
+			if((write_en) && (seqno == pseq) && (param >= APP_START) && (param < TOTAL_PROGRAM_MEMORY) && (nrows) &&
+			(nrows <= ((TOTAL_PROGRAM_MEMORY - param) / (LOADER_PAYLOAD >> 1))) && (!expand_rows(param, (u8) nrows, 0))){
+				expand_rows(param, (u8) nrows, 1);
 			}
 			else
 				acknak = NAK;
 			break;
+		#endif
 
-		case	BC_WRITE_EEPROM: // Write EEPROM in 64 byte chunks
+		#ifdef WITH_COPY
+		case	BC_COPY_PM: // Copy rows, param is the number of address pairs in the payload
+			if((write_en) && (seqno == pseq) && (param) && (param <= (LOADER_PAYLOAD >> 2)) && (!copy_rows((u8) param, 0))){
+				copy_rows((u8) param, 1);
+			}
+			else
+				acknak = NAK;
+			break;
+		#endif
+
+		#ifdef WITH_ERASE
+		case	BC_ERASE_PM: // Erase the number of rows in the first payload word, starting at param
+			nrows = make16(pkt.s.pl.payload[1], pkt.s.pl.payload[0]);
+			if((write_en) && (seqno == pseq) && (param >= APP_START) && (param < TOTAL_PROGRAM_MEMORY) &&
+			(nrows <= ((TOTAL_PROGRAM_MEMORY - param) / (LOADER_PAYLOAD >> 1)))){
+				for(; nrows; nrows--){
+					erase_program_eeprom(param);
+					param += (LOADER_PAYLOAD >> 1);
+					restart_wdt();
+				}
+			}
+			else
+				acknak = NAK;
+			break;
+		#endif
+
+		#ifdef WITH_WINDOW
+		case	BC_WRITE_PMW:
+		case	BC_WRITE_PMWA:
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMWP:
+		case	BC_WRITE_PMWPA:
+		#endif
+		#ifdef WITH_INTERLEAVE
+		case	BC_WRITE_PMWC:
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMWPC:
+		#endif
+		#endif
+			if(seqno == pseq)
+				wcount = wpkts = 0; // Window (re)started at the last committed packet, drop anything left over
+			if((write_en) && ((u16)(seqno + wpkts) == pseq) && (param >= APP_START) && ((wcount + prows) <= WINDOW_ROWS)){
+				for(j = 0; j < prows; j++){
+					row = packet_row(j, packed);
+					for(i = 0; i < LOADER_PAYLOAD; i++)
+						wbuf[wcount][i] = row[i];
+					waddr[wcount++] = param;
+					param += (LOADER_PAYLOAD >> 1);
+				}
+				wpkts++;
+			}
+			if((cmd == BC_WRITE_PMW) || (cmd == BC_WRITE_PMWP)){
+				acknak = NUL; // No response until the end of the window
+				break;
+			}
+			// End of window, program the rows received in sequence
+			for(i = 0; i < wcount; i++)
+				write_program_memory(waddr[i], wbuf[i], LOADER_PAYLOAD);
+			seqno += wpkts;
+			wcount = wpkts = 0;
+			acknak = ENQ; // Cumulative ACK
+			#ifdef WITH_INTERLEAVE
+			if((cmd == BC_WRITE_PMWC) || (cmd == BC_WRITE_PMWPC))
+				acknak = NUL; // The PC polls for the cumulative ACK once the bus is free
+			#endif
+			break;
+
+		#ifdef WITH_INTERLEAVE
+		case	BC_POLL:
+			acknak = ENQ; // Cumulative ACK for the packets committed so far
+			break;
+		#endif
+		#endif
+
+		#ifdef WITH_BROADCAST
+		case	BC_WRITE_PMB: // Sent to every node of the product, the sequence number is left alone
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMBP:
+		#endif
+			if((write_en) && (param >= APP_START)){
+				for(j = 0; j < prows; j++){
+					write_program_memory(param, packet_row(j, packed), LOADER_PAYLOAD);
+					param += (LOADER_PAYLOAD >> 1);
+				}
+			}
+			acknak = NUL; // The PC checks the rows of each node afterwards
+			break;
+		#endif
+
+		case	BC_WRITE_EEPROM: // Write EEPROM in 64 byte chunks, param is the byte address
 			if(write_en && (seqno == pseq)){
-				eeaddress = ((u8) param);				
-				for(i = 0; i < LOADER_PAYLOAD; i++)
-					write_eeprom(eeaddress, pkt.s.pl.payload[i]);
+				eeaddress = ((u8) param);
+				for(j = 0, row = pkt.s.pl.payload; j < prows; j++, row += LOADER_PAYLOAD){
+					for(i = 0; i < LOADER_PAYLOAD; i++)
+						write_eeprom(eeaddress++, row[i]);
+				}
 			}
 			else
 				acknak = NAK;
@@ -502,6 +1242,41 @@ u8 process_packet(void)
 				acknak = ACK; // Good
 			break;
 
+		#ifdef WITH_CHECK_CRC
+		case	BC_CHECK_CRC:
+			if(check_appspace() || (app_crc() != param))
+				acknak = STX; // Bad, or not the image the PC expects
+			else
+				acknak = ACK; // Good
+			break;
+		#endif
+
+		#ifdef WITH_COMPOUND
+		case	BC_CHECK_EXEC:
+			if(check_appspace())
+				acknak = STX; // Bad, stay in the loader
+			else
+				acknak = ETX; // Good, execute
+			break;
+		#endif
+
+		#ifdef WITH_ROW_CRC
+		case	BC_ROW_CRC: // Return CRCs of the rows starting at param, number of rows in the first payload byte
+			if((param >= APP_START) && (param < TOTAL_PROGRAM_MEMORY)){
+				nrows = (TOTAL_PROGRAM_MEMORY - param) / (LOADER_PAYLOAD >> 1);
+				if(pkt.s.pl.payload[0] > (LOADER_PAYLOAD >> 1))
+					pkt.s.pl.payload[0] = (LOADER_PAYLOAD >> 1);
+				if(pkt.s.pl.payload[0] > nrows)
+					pkt.s.pl.payload[0] = (u8) nrows;
+				acknak = SO;
+			}
+			else{
+				acknak = NAK;
+				nakreason = NR_RANGE;
+			}
+			break;
+		#endif
+
 		case	BC_RESET:
 		case	BC_EXEC_APP:
 			acknak = ETX;
@@ -509,6 +1284,7 @@ u8 process_packet(void)
 
 		default:
 			acknak = NAK;
+			nakreason = NR_CMD;
 			break;
 	}
 	if(acknak == ACK){
@@ -523,28 +1299,68 @@ void do_bootloader(void)
 {
 	u8 c;
 	u8 i;
+	u8 n, code;
+
+	#ifdef WITH_BAUD
+	setup_timer_1(T1_INTERNAL | T1_DIV_BY_8);
+	#endif
 
 	for(;;){
-		c = getc();
-		// wait for STX;
-		if(c != STX)
+		c = rx_byte();
+		// wait for STX or a COBS frame delimiter
+		if((c != STX) && (c != NUL))
 			continue;
 
+		cobs = (c == NUL);
 
 		// Get packet bytes
 
-		for(i = 0;;){
-			c = getc();
-			if(c == ETX)
-				break;
-			if(c == SUBST)
-				c = getc();
-			if(i < LOADER_BUFSIZE)
-				pkt.buffer[i++] = c;
+		if(cobs){
+			// Put the zeros back as the code bytes arrive
+			for(i = 0, n = 0, code = 0xFF;;){
+				c = rx_byte();
+				if(c == NUL){
+					if(i || n)
+						break;
+					code = 0xFF; // Nothing since the last delimiter, so this one starts the frame
+					continue;
+				}
+				if(n){
+					n--;
+				}
+				else{
+					if((code != 0xFF) && (i < LOADER_BUFSIZE))
+						pkt.buffer[i++] = NUL;
+					code = c;
+					n = c - 1;
+					continue;
+				}
+				if(i < LOADER_BUFSIZE)
+					pkt.buffer[i++] = c;
+			}
+			if(n)
+				i = 0; // Truncated, ignore
+		}
+		else{
+			for(i = 0;;){
+				c = rx_byte();
+				if(c == ETX)
+					break;
+				if(c == NUL){
+					i = 0; // Always escaped, so we started on an STX in a COBS frame. Ignore it.
+					break;
+				}
+				if(c == SUBST)
+					c = rx_byte();
+				if(i < LOADER_BUFSIZE)
+					pkt.buffer[i++] = c;
+			}
 		}
 
 		// Process packet
-		i = process_packet();
+		i = process_packet(i);
+		if(i == NUL)
+			continue; // No response, leave the bus alone
 		output_bit(TXEN, TRUE);
 		switch(i){
 			case	ACK:
@@ -555,10 +1371,24 @@ void do_bootloader(void)
 				putc(STX);
 				break;
 
+			#ifdef WITH_WINDOW
+			case	ENQ: // Cumulative ACK carrying the sequence number of the last row committed
+				putc(ACK);
+				putc(make8(seqno - 1, 0));
+				putc(make8(seqno - 1, 1));
+				break;
+			#endif
+
 			case	SOH:
 				send_query_response();
 				break;
 
+			#ifdef WITH_ROW_CRC
+			case	SO:
+				send_row_crcs();
+				break;
+			#endif
+
 			case	ETX:
 				putc(ACK);
 				delay_ms(1000);
@@ -572,6 +1402,11 @@ void do_bootloader(void)
 	
 			case	NAK:
 				putc(NAK);
+				if(naks){ // Reason, and the sequence number expected next
+					putc(nakreason);
+					putc(make8(seqno, 0));
+					putc(make8(seqno, 1));
+				}
 				break;
 			
 			default:
@@ -581,6 +1416,16 @@ void do_bootloader(void)
 		tx_wait_empty();
 		output_bit(TXEN, FALSE);
 
+		#ifdef WITH_BAUD
+		if(newbaud){ // ACK has gone out at the old rate, switch now
+			set_baud(newbaud - 1);
+			newbaud = 0;
+			set_timer1(0);
+			clear_interrupt(INT_TIMER1);
+			baud_ticks = BAUD_TIMEOUT;
+		}
+		#endif
+
 	}
 }
 
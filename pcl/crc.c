@@ -0,0 +1,49 @@
+/*
+* crc.c
+*
+* CRC-16 shared by pcl and the delta package code
+*
+* Copyright (C) 2010 Stephen Rodgers, All rights reserved.
+*
+*/
+
+/*
+* This file is part of the PBL (PIC Boot Loader) Project
+*
+*   PBL is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+
+*   PBL is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with PBL.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "crc.h"
+
+
+/* Calculate CRC over buffer using polynomial: X^16 + X^12 + X^5 + 1 */
+/* This must match the CRC calculated by the boot loader */
+
+unsigned short do_crc(unsigned short crcin, void *buf, unsigned int len)
+{
+	unsigned char i;
+	unsigned short crc = crcin;
+	unsigned char *b = (unsigned char *) buf;
+
+	while(len--){
+		crc ^= (((unsigned short) *b++) << 8);
+		for ( i = 0 ; i < 8 ; ++i ){
+			if (crc & 0x8000)
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc <<= 1;
+          	}
+	}
+	return crc;
+}
@@ -0,0 +1,13 @@
+/*
+* crc.h
+*
+* CRC-16 shared by pcl and the delta package code
+*
+*/
+
+#ifndef CRC_H
+#define CRC_H
+
+unsigned short do_crc(unsigned short crcin, void *buf, unsigned int len);
+
+#endif
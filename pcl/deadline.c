@@ -0,0 +1,73 @@
+/*
+* deadline.c
+*
+* Absolute CLOCK_MONOTONIC deadlines shared by the serial and socket I/O
+*
+*/
+
+/*
+* This file is part of the PBL (PIC Boot Loader) Project
+*
+*   PBL is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+
+*   PBL is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with PBL.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "deadline.h"
+
+
+/* Set a deadline usec microseconds from now */
+
+void deadline_set(struct timespec *deadline, long usec)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += usec / 1000000;
+	deadline->tv_nsec += (usec % 1000000) * 1000;
+	if(deadline->tv_nsec >= 1000000000){
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+
+/* Nanoseconds until a deadline, negative once it has passed */
+
+static long long deadline_nsec(struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) (deadline->tv_sec - now.tv_sec) * 1000000000 + (deadline->tv_nsec - now.tv_nsec);
+}
+
+
+/* Microseconds left until a deadline, 0 once it has passed */
+
+long deadline_left(struct timespec *deadline)
+{
+	long long nsec = deadline_nsec(deadline);
+
+	return (nsec > 0) ? (long) (nsec / 1000) : 0;
+}
+
+
+/* Milliseconds left until a deadline for poll(), rounded up so as not to wake early. -1 waits forever if there is no deadline */
+
+int deadline_ms(struct timespec *deadline)
+{
+	long long nsec;
+
+	if(!deadline)
+		return -1;
+	nsec = deadline_nsec(deadline);
+	return (nsec > 0) ? (int) ((nsec + 999999) / 1000000) : 0;
+}
@@ -0,0 +1,17 @@
+/*
+* deadline.h
+*
+* Absolute CLOCK_MONOTONIC deadlines shared by the serial and socket I/O
+*
+*/
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <time.h>
+
+void deadline_set(struct timespec *deadline, long usec);
+long deadline_left(struct timespec *deadline);
+int deadline_ms(struct timespec *deadline);
+
+#endif
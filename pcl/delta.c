@@ -0,0 +1,221 @@
+/*
+* delta.c
+*
+* Delta package reader and writer
+*
+* A delta package holds the rows of a new app image which differ from a known base image,
+* along with the new top row, and the app CRCs of the base and new images.
+* Rows which can be found elsewhere in the base image are carried as row copies instead.
+*
+* File layout, all 16 bit values are little endian:
+*
+* "PBLD", version byte, reserved byte
+* load_address, row_bytes, base_crc, new_crc, rowsused, count
+* ncopies (version 2 and later)
+* ncopies times: destination word address, source word address
+* count times: word address, row_bytes of row data
+* row_bytes of top row data
+* CRC of everything above
+*
+*/
+
+/*
+* This file is part of the PBL (PIC Boot Loader) Project
+*
+*   PBL is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 2 of the License, or
+*   (at your option) any later version.
+
+*   PBL is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with PBL.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "crc.h"
+#include "delta.h"
+
+#define DELTA_HEADER_SIZE 18
+#define DELTA_HEADER_SIZE_V2 20
+
+static void put16(unsigned char *p, unsigned short v)
+{
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+}
+
+static unsigned short get16(unsigned char *p)
+{
+	return p[0] | (((unsigned short) p[1]) << 8);
+}
+
+/* Size of a delta package in bytes */
+
+static unsigned delta_size(unsigned hdrsize, unsigned short row_bytes, unsigned short count, unsigned short ncopies)
+{
+	return hdrsize + (ncopies * 4) + (count * (row_bytes + 2)) + row_bytes + 2;
+}
+
+
+/* Allocate a delta with room for maxrows changed rows and maxrows row copies */
+
+delta_t *delta_new(unsigned short row_bytes, unsigned short maxrows)
+{
+	delta_t *d;
+
+	if(!(d = calloc(1, sizeof(delta_t))))
+		return NULL;
+	d->row_bytes = row_bytes;
+	d->wordaddr = malloc((maxrows + 1) * sizeof(unsigned short));
+	d->rows = malloc((maxrows + 1) * row_bytes);
+	d->toprow = malloc(row_bytes);
+	d->copydst = malloc((maxrows + 1) * sizeof(unsigned short));
+	d->copysrc = malloc((maxrows + 1) * sizeof(unsigned short));
+	if(!d->wordaddr || !d->rows || !d->toprow || !d->copydst || !d->copysrc){
+		delta_free(d);
+		return NULL;
+	}
+	return d;
+}
+
+
+void delta_free(delta_t *d)
+{
+	if(d){
+		free(d->wordaddr);
+		free(d->rows);
+		free(d->toprow);
+		free(d->copydst);
+		free(d->copysrc);
+		free(d);
+	}
+}
+
+
+/* Write a delta package. Returns 0 if successful, else -1 */
+
+int delta_write(char *path, delta_t *d)
+{
+	unsigned char *buf, *p;
+	unsigned size, i;
+	FILE *f;
+	int res = -1;
+
+	size = delta_size(DELTA_HEADER_SIZE_V2, d->row_bytes, d->count, d->ncopies);
+	if(!(buf = malloc(size)))
+		return -1;
+
+	p = buf;
+	memcpy(p, DELTA_MAGIC, 4);
+	p[4] = DELTA_VERSION;
+	p[5] = 0;
+	put16(p + 6, d->load_address);
+	put16(p + 8, d->row_bytes);
+	put16(p + 10, d->base_crc);
+	put16(p + 12, d->new_crc);
+	put16(p + 14, d->rowsused);
+	put16(p + 16, d->count);
+	put16(p + 18, d->ncopies);
+	p += DELTA_HEADER_SIZE_V2;
+	for(i = 0; i < d->ncopies; i++){
+		put16(p, d->copydst[i]);
+		put16(p + 2, d->copysrc[i]);
+		p += 4;
+	}
+	for(i = 0; i < d->count; i++){
+		put16(p, d->wordaddr[i]);
+		memcpy(p + 2, d->rows + (i * d->row_bytes), d->row_bytes);
+		p += d->row_bytes + 2;
+	}
+	memcpy(p, d->toprow, d->row_bytes);
+	p += d->row_bytes;
+	put16(p, do_crc(0, buf, size - 2));
+
+	if((f = fopen(path, "wb"))){
+		if(fwrite(buf, 1, size, f) == size)
+			res = 0;
+		if(fclose(f))
+			res = -1;
+	}
+	else
+		debug(DEBUG_INCOMPLETE, "fopen() failed in delta_write()");
+	free(buf);
+	return res;
+}
+
+
+/* Read and validate a delta package. Returns NULL if it could not be read or is corrupt */
+
+delta_t *delta_read(char *path)
+{
+	unsigned char hdr[DELTA_HEADER_SIZE_V2];
+	unsigned char *buf = NULL, *p;
+	unsigned size, hdrsize, i;
+	unsigned short row_bytes, count, ncopies = 0;
+	delta_t *d = NULL;
+	FILE *f;
+
+	if(!(f = fopen(path, "rb"))){
+		debug(DEBUG_INCOMPLETE, "fopen() failed in delta_read()");
+		return NULL;
+	}
+
+	if((fread(hdr, 1, DELTA_HEADER_SIZE, f) != DELTA_HEADER_SIZE) || memcmp(hdr, DELTA_MAGIC, 4) ||
+	(!hdr[4]) || (hdr[4] > DELTA_VERSION)){
+		debug(DEBUG_INCOMPLETE, "Bad delta header in delta_read()");
+		fclose(f);
+		return NULL;
+	}
+	hdrsize = DELTA_HEADER_SIZE;
+	if(hdr[4] >= 2){ // Version 2 adds row copies
+		if(fread(hdr + DELTA_HEADER_SIZE, 1, 2, f) != 2){
+			debug(DEBUG_INCOMPLETE, "Short header in delta_read()");
+			fclose(f);
+			return NULL;
+		}
+		hdrsize = DELTA_HEADER_SIZE_V2;
+		ncopies = get16(hdr + DELTA_HEADER_SIZE);
+	}
+	row_bytes = get16(hdr + 8);
+	count = get16(hdr + 16);
+	size = delta_size(hdrsize, row_bytes, count, ncopies);
+
+	if((buf = malloc(size))){
+		memcpy(buf, hdr, hdrsize);
+		if((fread(buf + hdrsize, 1, size - hdrsize, f) != size - hdrsize) ||
+		(do_crc(0, buf, size - 2) != get16(buf + size - 2))){
+			debug(DEBUG_INCOMPLETE, "Short read or CRC error in delta_read()");
+		}
+		else if((d = delta_new(row_bytes, (count > ncopies) ? count : ncopies))){
+			d->load_address = get16(buf + 6);
+			d->base_crc = get16(buf + 10);
+			d->new_crc = get16(buf + 12);
+			d->rowsused = get16(buf + 14);
+			d->count = count;
+			d->ncopies = ncopies;
+			p = buf + hdrsize;
+			for(i = 0; i < ncopies; i++){
+				d->copydst[i] = get16(p);
+				d->copysrc[i] = get16(p + 2);
+				p += 4;
+			}
+			for(i = 0; i < count; i++){
+				d->wordaddr[i] = get16(p);
+				memcpy(d->rows + (i * row_bytes), p + 2, row_bytes);
+				p += row_bytes + 2;
+			}
+			memcpy(d->toprow, p, row_bytes);
+		}
+	}
+	fclose(f);
+	free(buf);
+	return d;
+}
@@ -0,0 +1,34 @@
+/*
+* delta.h
+*
+* Delta package reader and writer
+*
+*/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#define DELTA_MAGIC "PBLD"
+#define DELTA_VERSION 2
+
+typedef struct{
+	unsigned short load_address;	/* Word address of the start of the app */
+	unsigned short row_bytes;	/* Bytes per row */
+	unsigned short base_crc;	/* App CRC of the image the delta applies to */
+	unsigned short new_crc;		/* App CRC after the delta has been applied */
+	unsigned short rowsused;	/* Rows used by the new app, not counting the top row */
+	unsigned short count;		/* Number of changed rows */
+	unsigned short *wordaddr;	/* Word address of each changed row */
+	unsigned char *rows;		/* Changed row data, count * row_bytes */
+	unsigned char *toprow;		/* New top row, row_bytes */
+	unsigned short ncopies;		/* Number of row copies, carried out before the changed rows are written */
+	unsigned short *copydst;	/* Word address of each row copy destination */
+	unsigned short *copysrc;	/* Word address of each row copy source in the base image */
+} delta_t;
+
+delta_t *delta_new(unsigned short row_bytes, unsigned short maxrows);
+void delta_free(delta_t *d);
+int delta_write(char *path, delta_t *d);
+delta_t *delta_read(char *path);
+
+#endif
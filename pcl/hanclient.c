@@ -84,6 +84,7 @@ int hanclient_connect_setup(char *pidpath, char *sockfilepath, char *service, ch
 int hanclient_send_command_return_res(Client_Command *client_command)
 {
 	int sock,i;
+	struct timespec deadline;
 
 	/* Attempt to connect to the han daemon */
   
@@ -107,10 +108,11 @@ int hanclient_send_command_return_res(Client_Command *client_command)
 
 	/* Write the client command block */
 
+	deadline_set(&deadline, USER_WRITE_TIMEOUT);
 	i = socket_write(sock,
 		(void *) client_command,
 		sizeof(Client_Command),
-		USER_WRITE_TIMEOUT);	
+		&deadline);	
 
 	if(i == 0){
 		debug(DEBUG_ACTION, "Socket time out error, writing client command");
@@ -123,16 +125,18 @@ int hanclient_send_command_return_res(Client_Command *client_command)
 
 	/* Wait for, and read back the response */
 
+	deadline_set(&deadline, USER_READ_TIMEOUT);
 	i = socket_read(sock,
 		(void *) client_command,
 		sizeof(Client_Command),
-		USER_READ_TIMEOUT);
+		&deadline);
 
 	if(i == 0){
 		debug(DEBUG_ACTION,"Socket time out error, waiting for response");
 		socket_close(sock);
 		return 1;
 	}
+	debug(DEBUG_ACTION, "Response after %ld of %ld us", USER_READ_TIMEOUT - deadline_left(&deadline), (long) USER_READ_TIMEOUT);
 	/* Close the socket */
 
 	socket_close(sock);
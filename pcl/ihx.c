@@ -47,12 +47,20 @@ void ihx_free(ihx_t *p)
 }
 
 
-ihx_t *ihx_read(char *path, unsigned char *buffer, unsigned int max_bytes)
+/*
+* Read a hex file into buffer, starting at the address of the first data record
+*
+* Extended segment (02) and extended linear (04) address records set the upper address bits of the data records which
+* follow. Data at or above limit is not program memory (config words, EEPROM data), and is skipped.
+*/
+
+ihx_t *ihx_read(char *path, unsigned char *buffer, unsigned int max_bytes, unsigned int limit)
 {
 	unsigned char gotfirstaddr = 0;
 	unsigned char rectype, checksum, bytecount;
 	unsigned char addrh, addrl;
 	unsigned int pos, addr, buffoffset, lineno;
+	unsigned int base = 0;
 	FILE *f;
 	ihx_t *ihx;
 	char line[HEXMAXLINE];
@@ -87,25 +95,49 @@ ihx_t *ihx_read(char *path, unsigned char *buffer, unsigned int max_bytes)
 			checksum += addrh;
 			addrl = hex2(line + 5);
 			checksum += addrl;
-			addr = (((unsigned int) addrh) << 8) + addrl;
+			addr = base + (((unsigned int) addrh) << 8) + addrl;
+			rectype = hex2(line + 7);
+			if((rectype == 2) || (rectype == 4)){
+				/* Extended address, checked and applied to the data records which follow */
+				checksum += rectype + hex2(line + 9) + hex2(line + 11);
+				checksum ^= 0xFF;
+				checksum++;
+				if((bytecount != 2) || (checksum != hex2(line + 13))){
+					ihx_free(ihx);
+					debug(DEBUG_INCOMPLETE, "Bad extended address record in ihx_read()");
+					return NULL;
+				}
+				base = (((unsigned int) hex2(line + 9)) << 8) + hex2(line + 11);
+				base <<= (rectype == 2) ? 4 : 16;
+				lineno++;
+				continue;
+			}
+			if((rectype == 3) || (rectype == 5)){
+				lineno++;
+				continue; /* Start address, not needed */
+			}
+			if(rectype != 0)
+				return ihx; /* Done */
+			if(addr >= limit){
+				debug(DEBUG_INCOMPLETE, "Line %u, Skipping data at %08X, above program memory", lineno, addr);
+				lineno++;
+				continue;
+			}
 			if(!gotfirstaddr){
 				ihx->load_address = addr;
 				buffoffset = 0;
 				gotfirstaddr = 1;
 			}
-			rectype = hex2(line + 7);
-			if(rectype != 0)
-				return ihx; /* Done */
 			buffoffset = addr - ihx->load_address;
 			if(buffoffset > ihx->size)
 				ihx->size = buffoffset; /* update size */
-			debug(DEBUG_INCOMPLETE, "Line %u, Load Address: %04X, Image Size: %d, Max Image Size: %d", lineno, addr, ihx->size, max_bytes);
+			debug(DEBUG_INCOMPLETE, "Line %u, Load Address: %08X, Image Size: %d, Max Image Size: %d", lineno, addr, ihx->size, max_bytes);
 			checksum += rectype;
 			pos = 9;
 			while(bytecount--){
 				if(ihx->size > max_bytes){
 					debug(DEBUG_INCOMPLETE, "Max bytes exceeded in ihx_read()");
-					debug(DEBUG_INCOMPLETE, "Load Address: %04X, Image Size: %u, Max Image Size: %u", addr, ihx->size, max_bytes);
+					debug(DEBUG_INCOMPLETE, "Load Address: %08X, Image Size: %u, Max Image Size: %u", addr, ihx->size, max_bytes);
 					debug(DEBUG_INCOMPLETE, "Offending line number and line in hex file: %u %s",lineno, line);
 					ihx_free(ihx);
 						return NULL;
@@ -147,7 +179,7 @@ void ihx_debug_dump(ihx_t *ihx)
 			printf(" ");
 	}
 	printf("\n\n");
-	printf("Load Address: %04X\n", ihx->load_address);
+	printf("Load Address: %08X\n", ihx->load_address);
 	printf("Image Size: %04X\n", ihx->size);
 }
 
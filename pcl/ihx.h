@@ -3,12 +3,12 @@
 #define HEXBUFFER 65536
 
 typedef struct{
-	unsigned short load_address;
+	unsigned load_address;
 	unsigned size;
 	unsigned char *buf;
 } ihx_t;
 
 void ihx_free(ihx_t *p);
-ihx_t *ihx_read(char *path, unsigned char *buffer, unsigned int max_bytes);
+ihx_t *ihx_read(char *path, unsigned char *buffer, unsigned int max_bytes, unsigned int limit);
 void ihx_debug_dump(ihx_t *ihx);
 
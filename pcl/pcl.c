@@ -32,6 +32,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <errno.h>
 #include <assert.h>
@@ -40,12 +41,14 @@
 #include "hanclient.h"
 #include "serio.h"
 #include "ihx.h"
+#include "crc.h"
+#include "delta.h"
 #include "iniparser.h"
 #include "error.h"
 
 
 #define BOOT_VERSION_SUPPORTED 0		/* Boot version supported (must be greater or equal to boot loader version) */
-#define MAX_PACKET 80				/* Maximum packet size */
+#define MAX_PACKET (PACKET_SIZE + ((MAX_PACKET_ROWS - 1) * LOADER_PAYLOAD) + FEC_BYTES) /* Maximum packet size */
 #define LOADER_PAYLOAD 64			/* Loader payload in bytes (must match loader) */
 
 
@@ -54,6 +57,9 @@
 #define ETX		0x03
 #define SUBST		0x04
 #define	HDC		0xFF
+#define	HDS		0xFE			/* Short packet type */
+#define	HDCF		0xFD			/* Full packet with FEC check bytes */
+#define	HDSF		0xFC			/* Short packet with FEC check bytes */
 #define	HDC_ACK		0xC1
 #define	HDC_NAK		0x81
 #define ENQ 		0x05
@@ -64,20 +70,109 @@
 /* Boot Loader Commands */
 #define BC_QUERY	0x00			/* Query command */
 #define BC_CHECK_APP	0x08			/* Check app integrity on target */
+#define BC_CHECK_CRC	0x09			/* Check app integrity on target, and that its CRC matches param */
+#define BC_ROW_CRC	0x0A			/* Return the CRCs of a range of program memory rows */
+#define BC_POLL		0x0B			/* Return a cumulative ACK for the packets committed so far */
 #define BC_WRITE_EN	0x10			/* Write enable */
+#define BC_SET_BAUD	0x11			/* Switch to the baud rate at index param in the baud rate list */
+#define BC_SET_ADDRU	0x12			/* Set bits 16-23 of the word address of the commands which follow */
+#define BC_ERASE_PM	0x20			/* Erase a range of program memory rows */
+#define BC_COPY_PM	0x21			/* Copy program memory rows on the target */
 #define BC_WRITE_PM	0x40			/* Write program memory */
+#define BC_WRITE_PMW	0x41			/* Write program memory, windowed, no response */
+#define BC_WRITE_PMWA	0x42			/* Write program memory, windowed, commit rows and send cumulative ACK */
+#define BC_WRITE_PMZ	0x43			/* Write program memory, run length coded rows */
+#define BC_WRITE_PMP	0x44			/* BC_WRITE_PM with 14 bit packed rows */
+#define BC_WRITE_PMWP	0x45			/* BC_WRITE_PMW with 14 bit packed rows */
+#define BC_WRITE_PMWPA	0x46			/* BC_WRITE_PMWA with 14 bit packed rows */
+#define BC_WRITE_PMC	0x47			/* BC_WRITE_PM, then BC_CHECK_APP */
+#define BC_WRITE_PMWC	0x48			/* BC_WRITE_PMWA without the response */
+#define BC_WRITE_PMWPC	0x49			/* BC_WRITE_PMWC with 14 bit packed rows */
+#define BC_WRITE_PMB	0x4A			/* Write program memory on every node of the product ID in seq, no response */
+#define BC_WRITE_PMBP	0x4B			/* BC_WRITE_PMB with 14 bit packed rows */
 #define BC_EXEC_APP	0x55			/* Execute App */
+#define BC_CHECK_EXEC	0x56			/* BC_CHECK_APP, then BC_EXEC_APP if good */
 #define BC_RESET	0xAA			/* Reset CPU */
 #define BC_WRITE_EEPROM	0xA5			/* Write config memory */
 
 
 #define PRODUCTID	0x2B36			/* Default Product ID */
-#define	PROTOCOL	0			/* Protocol */
+#define	PROTOCOL	5			/* Highest protocol supported */
+#define PROTO_WINDOW	1			/* First protocol with windowed writes */
+#define PROTO_ROWS	2			/* First protocol with multi row packets and byte addressed EEPROM rows */
+#define PROTO_COBS	3			/* First protocol with COBS framing */
+#define PROTO_SHORT	4			/* First protocol with short packets */
+#define PROTO_NAKR	5			/* First protocol with NAK reason codes */
+
+/* Capability flags in the query response */
+#define CAP_ERASE	0x01			/* BC_ERASE_PM supported */
+#define CAP_ROW_CRC	0x02			/* BC_ROW_CRC supported */
+#define CAP_CHECK_CRC	0x04			/* BC_CHECK_CRC supported */
+#define CAP_RLE		0x08			/* BC_WRITE_PMZ supported */
+#define CAP_COPY	0x10			/* BC_COPY_PM supported */
+#define CAP_BAUD	0x20			/* BC_SET_BAUD supported */
+#define CAP_PACK	0x40			/* BC_WRITE_PMP, BC_WRITE_PMWP and BC_WRITE_PMWPA supported */
+#define CAP_COMPOUND	0x80			/* QO_WRITE_EN, BC_WRITE_PMC and BC_CHECK_EXEC supported */
+
+/* More capability flags, in caps2 */
+#define CAP2_FEC	0x01			/* Packets may carry FEC check bytes */
+#define CAP2_INTERLEAVE	0x02			/* BC_WRITE_PMWC, BC_WRITE_PMWPC and BC_POLL supported */
+#define CAP2_BROADCAST	0x04			/* BC_WRITE_PMB and BC_WRITE_PMBP supported */
+#define CAP2_ADDRU	0x08			/* BC_SET_ADDRU supported, and appsizeu reported */
+
+/* BC_QUERY param */
+#define QUERY_PARAM	0x55AA			/* Without options, not required by protocol */
+#define QUERY_OPTS	0xA500			/* High byte of a param which carries option bits in the low byte */
+#define QO_WRITE_EN	0x01			/* Also enable writes (CAP_COMPOUND) */
+#define QO_NAK_REASON	0x02			/* Follow each NAK with a reason code and the expected sequence number */
+
+/* NAK reason codes */
+#define NR_CRC		0x01			/* Bad CRC */
+#define NR_LENGTH	0x02			/* Bad packet length */
+#define NR_SEQ		0x03			/* Sequence number is not the one expected */
+#define NR_WRITE_EN	0x04			/* Writes not enabled */
+#define NR_RANGE	0x05			/* Address, count or payload out of range */
+#define NR_CMD		0x06			/* Unknown command */
 
 #define	PACKET_SIZE 80				/* Size of a packet */
+#define MAX_PACKET_ROWS 3			/* Maximum number of rows in one write packet (short packet length is a byte) */
+#define SHORT_LEN 7				/* Offset of the payload length in a short packet */
+#define SHORT_OVERHEAD 10			/* Header, length and CRC bytes in a short packet */
+#define FEC_WAYS 4				/* Interleaved FEC codewords per packet, one byte error can be corrected in each */
+#define FEC_BYTES (FEC_WAYS * 2)		/* FEC check bytes after the CRC */
+#define GF_INV3 0xF4				/* 1 / (x + 1) in GF(256), polynomial 0x11D */
+#define COBS_BLOCK 254				/* Maximum number of non zero bytes per COBS code byte */
+#define MAX_COBS_FRAME (MAX_PACKET + (MAX_PACKET / COBS_BLOCK) + 3) /* Delimiters, code bytes and data */
+#define MAX_STUFFED_FRAME ((MAX_PACKET * 2) + 2) /* STX, ETX and data with every byte escaped */
 #define MAX_PATH 128				/* Maximum path name length + 1 */
 #define	MAX_CF 32				/* Config memory size in bytes */
 #define PACKET_RETRIES 5			/* Number of retries to do when NAK is received on a packet */
+#define MAX_WINDOW 16				/* Maximum number of rows in flight */
+#define WACK_SIZE 3				/* Size of a cumulative ACK: ACK, last good seq low, last good seq high */
+#define NAK_SIZE 4				/* Size of a NAK with a reason: NAK, reason, expected seq low, expected seq high */
+#define ERASE_ROWS_MAX 64			/* Maximum number of rows to erase with one BC_ERASE_PM packet */
+#define ROW_CRC_MAX (LOADER_PAYLOAD >> 1)	/* Maximum number of row CRCs returned in one BC_ROW_CRC packet */
+#define RLE_ROWS_MAX 16				/* Maximum number of rows in one BC_WRITE_PMZ packet */
+#define RLE_RUN 0x80				/* Run length token flag, also the maximum number of words per token */
+#define COPY_MAX (LOADER_PAYLOAD >> 2)		/* Maximum number of row copies in one BC_COPY_PM packet */
+#define PACKED_ROW ((LOADER_PAYLOAD >> 3) * 7)	/* Bytes in a 14 bit packed row, 4 words in 7 bytes */
+#define MAX_BAUDS 8				/* Size of the baud rate list in the query response */
+#define BAUD_SYNC_TIMEOUT 500000		/* Microseconds to wait for the query response after a baud rate change */
+#define BAUD_FALLBACK_DELAY 1500000		/* Microseconds for the loader to fall back to its power up rate */
+#define MAX_NODES 32				/* Maximum number of nodes programmed at once */
+#define BROADCAST_ADDR 0xFF			/* Node address of broadcast writes */
+#define SAME_PAGE(a, b) ((((a) ^ (b)) >> 16) == 0)	/* Word addresses a and b have the same bits 16-23 */
+#define JOURNAL_ROWS 16				/* Rows acknowledged between journal checkpoints */
+#define ROW_PROGRAM_TIME 5000			/* Microseconds for the loader to erase and write one row, with margin */
+#define RTT_MIN_TIMEOUT 20000			/* Microseconds, floor on a timeout worked out from the round trip times */
+#define RTT_MAX_TIMEOUT 5000000			/* Microseconds, ceiling on a timeout, backoff included */
+#define RTT_MAX_BACKOFF 6			/* Maximum number of times a timeout is doubled after failures */
+#define RETRY_DELAY 100000			/* Microseconds to wait before a retry, until round trip times are known */
+#define ENTRY_TIMEOUT 5000000			/* Microseconds for the boot loader to answer after the entry command */
+#define ENTRY_PROBE_MARGIN 50000		/* Microseconds allowed for the loader to turn a query probe round */
+#define HAN_BAUD 9600				/* Baud rate of the HAN bus, and of the loader at power up in addressable mode */
+#define HAND_RX_TIMEOUT 500000			/* Microseconds hand is given to receive a query response */
+#define WIRE_TIME(len, baud) ((long) (len) * 10000000L / (baud)) /* Microseconds for len bytes at baud, 10 bits a byte */
 
 // Buffer offsets for CRC and Signature in last row
 
@@ -127,7 +222,7 @@ struct packet_s_han {
 typedef struct packet_s_han packet_t_han;
 
 typedef union packet_u {
-	u8 buffer[PACKET_SIZE];
+	u8 buffer[MAX_PACKET];
 	packet_t_pbl pbl;
 	packet_t_han han;
 } packet_t;
@@ -139,10 +234,57 @@ struct response_s {
 	u8  bootvers;
 	u8  proto;
 	u8  config[MAX_CF];
+	u8  window;				/* Rows the loader can buffer in windowed mode (protocol 1 and later) */
+	u8  caps;				/* Capability flags */
+	u16 bauds[MAX_BAUDS];			/* Baud rates the loader can switch to, in units of 100 baud, zero terminated */
+	u8  rowwords;				/* Flash row size in words, 0 if not reported */
+	u8  maxrows;				/* Maximum number of rows in one write packet, 0 if not reported */
+	u16 eesize;				/* Data EEPROM size in bytes, 0 if not reported */
+	u8  caps2;				/* More capability flags, 0 if not reported */
+	u8  appsizeu;				/* Bits 16-23 of appsize (CAP2_ADDRU) */
 }__attribute__((__packed__)); 
 
 typedef struct response_s response_t;
 
+/* A row to be written to the target */
+
+typedef struct {
+	u32 wordaddr;
+	u8 *data;
+} row_t;
+
+/* Session with one node, when several nodes on the bus are programmed at once */
+
+typedef struct {
+	u16 addr;				/* Node address */
+	u16 seqno;				/* Sequence number of the next packet to the node */
+	u32 base;				/* Index of the first row the node has not acknowledged */
+	u32 npkts;				/* Packets in the window in flight, 0 if none */
+	u8 pktrows[MAX_WINDOW];			/* Rows in each of them */
+	int retries;				/* Windows resent since the last one which got through */
+	struct timespec ready;			/* When the node should have programmed the window */
+} node_t;
+
+/* Round trip time estimate for one command, Jacobson/Karels style */
+
+typedef struct {
+	u32 samples;				/* Round trips measured */
+	long srtt;				/* Smoothed round trip time in us, times 8 */
+	long rttvar;				/* Smoothed mean deviation in us, times 4 */
+} rtt_t;
+
+/* Receive frame decoder, fed one byte at a time */
+
+#define FS_HUNT		0			/* Looking for the start of a frame */
+#define FS_DATA		1			/* In a frame */
+#define FS_SUBST	2			/* In a frame, after a SUBST */
+
+typedef struct {
+	u8 state;				/* One of the FS_ states */
+	int len;				/* Bytes in frame so far */
+	u8 frame[MAX_COBS_FRAME];		/* COBS frame without delimiters, or unstuffed packet */
+} rxframe_t;
+
 struct config_area_s {
 	u16	user1;
 	u16	user2;
@@ -170,6 +312,15 @@ typedef struct {
 	int hanmode : 1;
 	int handisrunning : 1;
 	int configfileoverride : 1;
+	int sparse : 1;
+	int differential : 1;
+	int makedelta : 1;
+	int nocopy : 1;
+	int cobs : 1;
+	int shortpkt : 1;
+	int nakreason : 1;
+	int fec : 1;
+	int rs485 : 1;
 } flags_t;
 
 /*
@@ -185,22 +336,54 @@ static Client_Command client_command;
 static packet_t packet;
 static u16 productid = PRODUCTID;
 static u8 packet_size;
+static int packet_txsize;
+static u8 packet_rows = 1;
+static u32 cobs_bytes;				/* Bytes sent with COBS framing */
+static u32 stuffed_bytes;			/* Bytes the same packets would have taken with byte stuffing */
+static u16 seqno;
+static u8 addru;				/* Bits 16-23 of the word address last set on the loader */
+/* Checkpoint journal of a program memory write */
+
+typedef struct {
+	char path[(MAX_PATH * 2) + 16];		/* Journal file, empty if the session is not journalled */
+	u16 imagecrc;				/* CRC of the addresses and data of the rows to write */
+	u32 nrows;				/* Number of rows to write */
+	u32 start;				/* Row the writes started at */
+	u32 acked;				/* Rows acknowledged at the last checkpoint */
+} journal_t;
+
+static journal_t journal;
+static node_t nodes[MAX_NODES];			/* Nodes given with -a, the first one is hannodeaddr */
+static int nnodes = 1;
+static node_t *curnode = nodes;			/* Node packets are sent to */
+static u16 queryparam = QUERY_PARAM;
+static rtt_t rtts[256];				/* Round trip times of each command */
+static int backoff;				/* Failures since the last measured round trip, each doubles the timeouts */
+static long rtt_last;				/* Microseconds the last response took, 0 if there was none */
+static unsigned maxbaud;
 
 /* Commandline options. */
 
-#define SHORT_OPTIONS "a:cd:ef:hio:p:rvVxz:"
+#define SHORT_OPTIONS "a:b:cCd:Def:hij:m:o:O:p:rsvVxz:"
 
 static struct option long_options[] = {
   {"address", 1, 0, 'a'},
+  {"baud", 1, 0, 'b'},
   {"check-after-programming", 0, 0, 'c'},
   {"debug", 1, 0, 'd'},
+  {"differential", 0, 0, 'D'},
   {"eeprom", 0, 0, 'e'},
   {"file", 1, 0, 'f'},
   {"help", 0, 0, 'h'},
   {"interrogate-only", 0, 0, 'i'},
+  {"journal", 1, 0, 'j'},
+  {"make-delta", 1, 0, 'm'},
+  {"no-copy", 0, 0, 'C'},
+  {"output", 1, 0, 'O'},
   {"product-id", 1, 0, 'o'},
   {"port", 1, 0, 'p'},
   {"reset", 0, 0, 'r'},
+  {"sparse", 0, 0, 's'},
   {"verbose", 0, 0, 'v'},
   {"version", 0, 0, 'V'},
   {"execute-after-programming", 0, 0, 'x'},
@@ -209,12 +392,17 @@ static struct option long_options[] = {
 };
  
 static char file[MAX_PATH];
+static char basefile[MAX_PATH];
+static char outfile[MAX_PATH];
 static char port[MAX_PATH];
 static char service[MAX_PATH] = "1128";
 static char host[MAX_PATH] = "::1";
 static char config_file[MAX_PATH] = "pcl.conf";
+static char journal_dir[MAX_PATH];
 
 static char *not_comp = "Hand not compatible with pcl";
+static char *nak_reasons[] = {"unknown", "bad CRC", "bad length", "wrong sequence number", "writes not enabled",
+"out of range", "unknown command"};
 
 /*
 * Start of code
@@ -240,127 +428,325 @@ void hex_dump(void *buf, u32 size, u8 printaddr)
 }
 
 
-/* Calculate CRC over buffer using polynomial: X^16 + X^12 + X^5 + 1 */
+/* Fill a buffer with the program memory erase pattern */
 
-static u16  do_crc(u16 crcin, void *buf, u16 len)
+static void fill_erase_pattern(u8 *buf, u32 len)
 {
-	u8 i;
-	u16 crc = crcin;
-	u8 *b = (u8 *) buf;
-
-	while(len--){
-		crc ^= (((u16) *b++) << 8);
-		for ( i = 0 ; i < 8 ; ++i ){
-			if (crc & 0x8000)
-				crc = (crc << 1) ^ 0x1021;
-			else
-				crc <<= 1;
-          	}
-	}
-	return crc;
+	u32 i;
+
+	for(i = 0 ; i < len; i++)
+		buf[i] = (i & 1) ? 0x3F : 0xFF;
 }
 
 
-/* Transmit a packet */
+/* Write the signature, rows used and app CRC into the info bytes of a top row */
 
-static int packet_tx(serioStuff *s, void *p, size_t size, int timeout)
+static void info_row_fill(u8 *lastrow, u16 rowsexceptlast, u16 crc16)
 {
-	if(!flags.hanmode){
-		return serio_write(s, p, size, timeout);
-	}
-	else{
-		int res;
-		int xfrcount;
-		static u8 ctrlchars[3] = {SUBST,STX,ETX};
+	lastrow[SIGLO] = 0xAA;
+	lastrow[SIGLO + 1] = 0; // 6 bit locations are useless, zero them out for readability.
+	lastrow[SIGHI] = 0x55;
+	lastrow[SIGHI + 1] = 0;
+	lastrow[RULO] = (u8) rowsexceptlast;
+	lastrow[RULO + 1] = 0;
+	lastrow[RUHI] = (u8) (rowsexceptlast >> 8);
+	lastrow[RUHI + 1] = 0;
+	lastrow[RFULO] = 0;
+	lastrow[RFULO + 1] = 0;
+	lastrow[RFUHI] = 0;
+	lastrow[RFUHI + 1] = 0;
+	lastrow[CRCLO] = (u8) crc16;
+	lastrow[CRCLO + 1] = 0;
+	lastrow[CRCHI] = (u8) (crc16 >> 8);
+	lastrow[CRCHI + 1] = 0;
+}
 
-		res = serio_write(s, ctrlchars + 1, 1, timeout);
 
-		for(xfrcount = 0; (res == 1) && (xfrcount < size); xfrcount++){
-			if(((u8 *)p)[xfrcount] <= SUBST){
-				res = serio_write(s, ctrlchars, 1, timeout); /* Write SUBST */
-			}
-			if(res == 1){
-				res = serio_write(s, ((u8 *) p) + xfrcount, 1, timeout);
-			}
+/*
+* Find a row's worth of words in the base image which matches row. Returns the word offset from the start
+* of the base image, or -1 if there is none. The offset which matched the previous row is tried first, since code
+* shifted by the linker moves as a block.
+*/
+
+static long find_row(u8 *basebuf, u16 baserows, u8 *row, u16 rowindex, long *shift)
+{
+	long src, last = (long) baserows * (LOADER_PAYLOAD >> 1) - (LOADER_PAYLOAD >> 1);
+
+	src = (long) rowindex * (LOADER_PAYLOAD >> 1) - *shift;
+	if((src >= 0) && (src <= last) && !memcmp(basebuf + (src << 1), row, LOADER_PAYLOAD))
+		return src;
+
+	for(src = 0; src <= last; src++){
+		if(!memcmp(basebuf + (src << 1), row, LOADER_PAYLOAD)){
+			*shift = (long) rowindex * (LOADER_PAYLOAD >> 1) - src;
+			return src;
 		}
-		if(res == 1){
-			res = serio_write(s, ctrlchars + 2, 1, timeout);
-		}	
-		return (res < 0) ? res : xfrcount;
 	}
-
+	return -1;
 }
 
-/* Receive a packet */
 
-static int packet_rx(serioStuff *s, void *p, size_t size, int timeout)
-{
+/* Adjust the reference counts of the base rows spanned by a copy source */
 
-	if(!flags.hanmode){
-		return  serio_read(s, p, size, timeout);
+static void copy_ref(u16 *srcref, long src, int adj)
+{
+	srcref[src / (LOADER_PAYLOAD >> 1)] += adj;
+	if(src % (LOADER_PAYLOAD >> 1))
+		srcref[src / (LOADER_PAYLOAD >> 1) + 1] += adj;
+}
 
-	}
-	else{
-		int res;
-		u8 b[2];
-		int xfrcount = 0;
 
-		do{
-			res = serio_read(s, b, 1, timeout);
-		}
-		while((res == 1) && (b[0] != STX));
+/*
+* Make a delta package from a base hex file to a new hex file
+*
+* The package holds the rows of the new image which differ from the base image, the new top row,
+* and the app CRC of the base image so the target can be checked before the delta is applied.
+*
+* A changed row which is found elsewhere in the base image, such as code the linker shifted, is sent as a row copy.
+* Copies are carried out in the order planned here, before any rows are written. A copy can only be made once no
+* other pending copy needs to read the base contents of its destination. Copies which depend on each other in a
+* cycle are broken up by sending one of them as row data.
+*/
 
+#define ROW_SAME 0
+#define ROW_DATA 1
+#define ROW_COPY 2
+#define ROW_COPIED 3
 
-		for(xfrcount = 0; (res == 1); xfrcount++){
-			res = serio_read(s, b, 1, timeout);
+static void make_delta(char *basepath, char *newpath, char *outpath)
+{
+	u8 *basebuf, *newbuf, *b, *n, *state;
+	u16 i, load_address, baserows, newrows, progress, self;
+	u16 *srcref;
+	long *copysrc = NULL, src, shift = 0;
+	ihx_t *ihx;
+	delta_t *d;
 
-			if(res != 1){
-				break;
-			}
+	if(!(basebuf = malloc(HEXBUFFER)) || !(newbuf = malloc(HEXBUFFER)))
+		fatal("No memory for buffer");
+	fill_erase_pattern(basebuf, HEXBUFFER);
+	fill_erase_pattern(newbuf, HEXBUFFER);
+
+	if(!(ihx = ihx_read(basepath, basebuf, HEXBUFFER, HEXBUFFER)))
+		fatal("Could not open and/or read hex file %s", basepath);
+	load_address = ihx->load_address >> 1;
+	baserows = (ihx->size + LOADER_PAYLOAD - 1) / LOADER_PAYLOAD;
+	ihx_free(ihx);
+
+	if(!(ihx = ihx_read(newpath, newbuf, HEXBUFFER, HEXBUFFER)))
+		fatal("Could not open and/or read hex file %s", newpath);
+	if((ihx->load_address >> 1) != load_address)
+		fatal("Base and new hex files have different load addresses");
+	newrows = (ihx->size + LOADER_PAYLOAD - 1) / LOADER_PAYLOAD;
+	ihx_free(ihx);
+
+	if(!(d = delta_new(LOADER_PAYLOAD, newrows)))
+		fatal("No memory for delta");
+
+	d->load_address = load_address;
+	d->rowsused = newrows;
+	d->base_crc = do_crc(0, basebuf, baserows * LOADER_PAYLOAD);
+	d->new_crc = do_crc(0, newbuf, newrows * LOADER_PAYLOAD);
+
+	if(!(state = calloc(newrows, 1)) || !(copysrc = calloc(newrows, sizeof(long))) ||
+	!(srcref = calloc(baserows + 1, sizeof(u16))))
+		fatal("No memory for copy planner");
+
+	/* Classify each row of the new image */
+
+	for(i = 0; i < newrows; i++){
+		b = basebuf + (i * LOADER_PAYLOAD);
+		n = newbuf + (i * LOADER_PAYLOAD);
+		// Rows past the end of the base app are not covered by its CRC, so their contents on the target are unknown
+		if((i < baserows) && !memcmp(b, n, LOADER_PAYLOAD))
+			state[i] = ROW_SAME;
+		else if((!flags.nocopy) && ((src = find_row(basebuf, baserows, n, i, &shift)) >= 0)){
+			state[i] = ROW_COPY;
+			copysrc[i] = src;
+			copy_ref(srcref, src, 1);
+		}
+		else
+			state[i] = ROW_DATA;
+	}
 
-			if(b[0] == ETX){
+	/* Order the copies so that no copy overwrites the source of a copy still pending */
+
+	for(progress = 1; progress;){
+		progress = 0;
+		for(i = 0; i < newrows; i++){
+			if(state[i] != ROW_COPY)
+				continue;
+			self = ((copysrc[i] / (LOADER_PAYLOAD >> 1)) == i);
+			if((copysrc[i] % (LOADER_PAYLOAD >> 1)) && ((copysrc[i] / (LOADER_PAYLOAD >> 1) + 1) == i))
+				self++;
+			if((i < baserows) && (srcref[i] != self))
+				continue; // Base contents of this row are still needed
+			d->copydst[d->ncopies] = load_address + (i * (LOADER_PAYLOAD >> 1));
+			d->copysrc[d->ncopies++] = (u16) (load_address + copysrc[i]);
+			copy_ref(srcref, copysrc[i], -1);
+			state[i] = ROW_COPIED;
+			progress = 1;
+		}
+		if(progress)
+			continue;
+		for(i = 0; i < newrows; i++){ // Stuck in a cycle, send the first pending copy as data instead
+			if(state[i] == ROW_COPY){
+				state[i] = ROW_DATA;
+				progress = 1;
 				break;
 			}
+		}
+		if(progress)
+			copy_ref(srcref, copysrc[i], -1);
+	}
 
-			else if(b[0] == SUBST){
-				res = serio_read(s, b, 1, timeout);
+	/* The rest are sent as row data, in address order */
 
-				if(res != 1){
-					break;
-				}
-			}
-			if(xfrcount < size)
-				((u8 *) p)[xfrcount] = b[0];
-		}
-		return (res < 0) ? res : xfrcount;
+	for(i = 0; i < newrows; i++){
+		if(state[i] != ROW_DATA)
+			continue;
+		d->wordaddr[d->count] = load_address + (i * (LOADER_PAYLOAD >> 1));
+		memcpy(d->rows + (d->count * LOADER_PAYLOAD), newbuf + (i * LOADER_PAYLOAD), LOADER_PAYLOAD);
+		d->count++;
 	}
 
+	fill_erase_pattern(d->toprow, LOADER_PAYLOAD);
+	info_row_fill(d->toprow, newrows, d->new_crc);
+
+	if(delta_write(outpath, d))
+		fatal("Could not write delta package %s", outpath);
+
+	printf("%u of %u rows changed, %u of them sent as row copies, base CRC 0x%04X, new CRC 0x%04X\n",
+	d->count + d->ncopies, newrows, d->ncopies, d->base_crc, d->new_crc);
+
+	free(state);
+	free(copysrc);
+	free(srcref);
+	delta_free(d);
+	free(basebuf);
+	free(newbuf);
 }
 
 
-/* Zero out the packet buffer */
+/*
+* COBS encode a packet into a frame with a zero delimiter at each end. No other byte in the frame is zero.
+* Returns the length of the frame.
+*/
 
-static void packet_init(void)
+static int cobs_encode(u8 *dest, u8 *src, int count)
 {
-	memset(packet.buffer, 0, sizeof(packet_t));
-	if(!flags.hanmode){
-		packet.pbl.id = STX;
+	int i, n, block, res = 0;
+
+	dest[res++] = 0;
+	for(i = 0;;){
+		for(n = i; (n < count) && (src[n]) && (n - i < COBS_BLOCK); n++)
+			;
+		block = n - i;
+		dest[res++] = (u8) (block + 1);
+		for(; i < n; i++)
+			dest[res++] = src[i];
+		if(n == count)
+			break;
+		if(block < COBS_BLOCK)
+			i++; // The zero is implied by the code byte, a full block (code 0xFF) implies none
 	}
+	dest[res++] = 0;
+	return res;
 }
 
-/* Calculate CRC over the packet buffer minus the size of an u16 */
+/*
+* Decode a COBS frame without its delimiters
+* Returns the length of the packet, or 0 if the frame is malformed or the packet does not fit in size bytes
+*/
 
-static void packet_finalize(void)
-{	
-	u16 crc16;
-	crc16 = do_crc(0, packet.buffer, packet_size - sizeof(u16));
-	if(flags.hanmode){
-		packet.han.crc16 = crc16;
+static int cobs_decode(u8 *dest, u8 *src, int count, int size)
+{
+	int i, n, len;
+	u8 code;
+
+	for(i = 0, len = 0; i < count;){
+		code = src[i++];
+		if((!code) || (i + code - 1 > count))
+			return 0;
+		for(n = 1; n < code; n++){
+			if(len == size)
+				return 0;
+			dest[len++] = src[i++];
+		}
+		if((code != 0xFF) && (i < count)){
+			if(len == size)
+				return 0;
+			dest[len++] = 0;
+		}
 	}
-	else{
-		packet.pbl.crc16 = crc16;
+	return len;
+}
+
+
+/*
+* Round trip check of the COBS encoder and decoder, including a full block of COBS_BLOCK non zero bytes
+* followed by a zero, which must not be swallowed by the full block's code byte.
+* Returns 1 if the decoded packet matches the original.
+*/
+
+static int cobs_check(void)
+{
+	int i, len;
+	u8 src[COBS_BLOCK + 8];
+	u8 dec[COBS_BLOCK + 8];
+	u8 frame[COBS_BLOCK + 16];
+
+	for(i = 0; i < COBS_BLOCK; i++)
+		src[i] = (u8) ((i % 255) + 1);
+	src[COBS_BLOCK] = 0;
+	src[COBS_BLOCK + 1] = 0;
+	for(i = COBS_BLOCK + 2; i < sizeof(src); i++)
+		src[i] = (u8) i;
+	len = cobs_encode(frame, src, sizeof(src));
+	// The decoder is given the frame without its delimiters, as packet_rx() does
+	if(cobs_decode(dec, frame + 1, len - 2, sizeof(dec)) != sizeof(src))
+		return 0;
+	return !memcmp(src, dec, sizeof(src));
+}
+
+/* Multiply a by b in GF(256), polynomial 0x11D */
+
+static u8 gf_mul(u8 a, u8 b)
+{
+	u8 r;
+
+	for(r = 0; b; b >>= 1){
+		if(b & 1)
+			r ^= a;
+		a = (a & 0x80) ? (a << 1) ^ 0x1D : a << 1;
 	}
-	
+	return r;
+}
+
+/*
+* Append FEC check bytes to the len bytes in buf, and return the number of check bytes.
+* Byte i is in codeword w = i % FEC_WAYS, which starts with check bytes c0 = buf[len + 2w] and c1 = buf[len + 2w + 1].
+* They make the sum of the codeword bytes zero, and the sum of each byte times x to the power of its position in
+* the codeword, so the loader can put one bad byte right in each codeword:
+*   c0 + c1 + a = 0 and c0 + c1 x + b = 0, where a and b are the sums over the bytes from buf
+*/
+
+static int fec_encode(u8 *buf, int len)
+{
+	int w, i;
+	u8 a, b, c1;
+
+	for(w = 0; w < FEC_WAYS; w++){
+		for(a = 0, b = 0, i = w + (((len - 1 - w) / FEC_WAYS) * FEC_WAYS); i >= w; i -= FEC_WAYS){
+			a ^= buf[i];
+			b = gf_mul(b, 2) ^ buf[i]; // Horner's rule
+		}
+		b = gf_mul(b, 4); // Bytes from buf start at position 2
+		c1 = gf_mul(a ^ b, GF_INV3);
+		buf[len + (w << 1)] = a ^ c1;
+		buf[len + (w << 1) + 1] = c1;
+	}
+	return FEC_BYTES;
 }
 
 
@@ -386,6 +772,172 @@ static int packet_format(void *dest, void *src, int count)
 	return res;
 }
 
+
+/* Transmit a packet */
+
+static int packet_tx(serioStuff *s, void *p, size_t size, struct timespec *deadline)
+{
+	if(!flags.hanmode){
+		return serio_write(s, p, size, deadline);
+	}
+	else if(flags.cobs){
+		int i, res, len;
+		u8 frame[MAX_COBS_FRAME];
+
+		len = cobs_encode(frame, p, size);
+		if((res = serio_write(s, frame, len, deadline)) < 0)
+			return res;
+
+		// Keep track of what the escapes would have cost
+		cobs_bytes += len;
+		stuffed_bytes += size + 2;
+		for(i = 0; i < size; i++){
+			if(((u8 *)p)[i] <= SUBST)
+				stuffed_bytes++;
+		}
+		return (res == len) ? size : 0;
+	}
+	else{
+		int res, len;
+		u8 frame[MAX_STUFFED_FRAME];
+
+		// Escape the whole frame first, so it goes to the port in one write
+		len = packet_format(frame, p, size);
+		if((res = serio_write(s, frame, len, deadline)) < 0)
+			return res;
+		return (res == len) ? size : 0;
+	}
+
+}
+
+/*
+* Decode the next received byte of a frame.
+* Returns 1 when the frame is complete, else 0
+*/
+
+static int frame_decode(rxframe_t *f, u8 b)
+{
+	if(flags.cobs){
+		if(f->state == FS_HUNT){
+			if(b) // Skip delimiters
+				f->state = FS_DATA;
+			else
+				return 0;
+		}
+		if(!b)
+			return 1;
+	}
+	else{
+		if(f->state == FS_HUNT){
+			if(b == STX)
+				f->state = FS_DATA;
+			return 0;
+		}
+		if(f->state == FS_SUBST)
+			f->state = FS_DATA;
+		else if(b == ETX)
+			return 1;
+		else if(b == SUBST){
+			f->state = FS_SUBST;
+			return 0;
+		}
+	}
+	if(f->len < sizeof(f->frame))
+		f->frame[f->len++] = b;
+	return 0;
+}
+
+
+/*
+* Resync check of the receive frame decoder. Two COBS frames are sent back to back, and the decoder starts listening
+* at each byte of the first one in turn, as if it had missed the bytes before. It must decode the second frame.
+* Returns 1 if it does from every starting point.
+*/
+
+static int frame_check(void)
+{
+	int i, j, len, first, res = 1;
+	u8 cobs = flags.cobs;
+	u8 src[2][24];
+	u8 dec[sizeof(src[0])];
+	u8 stream[2 * (sizeof(src[0]) + 4)];
+	rxframe_t f;
+
+	for(i = 0; i < sizeof(src[0]); i++){
+		src[0][i] = (u8) (i % 5); // Zeros every few bytes
+		src[1][i] = (u8) (i % 3);
+	}
+	first = cobs_encode(stream, src[0], sizeof(src[0]));
+	len = first + cobs_encode(stream + first, src[1], sizeof(src[1]));
+
+	flags.cobs = 1;
+	for(i = 0; (i < first) && res; i++){
+		f.state = FS_HUNT;
+		f.len = 0;
+		for(j = i, res = 0; j < len; j++){
+			if(!frame_decode(&f, stream[j]))
+				continue;
+			// Only the frame which ends with the stream counts
+			res = (j == len - 1) && (cobs_decode(dec, f.frame, f.len, sizeof(dec)) == sizeof(dec)) &&
+			(!memcmp(dec, src[1], sizeof(dec)));
+			f.state = FS_HUNT;
+			f.len = 0;
+		}
+	}
+	flags.cobs = cobs;
+	return res;
+}
+
+
+/* Receive a packet */
+
+static int packet_rx(serioStuff *s, void *p, size_t size, struct timespec *deadline)
+{
+	int res;
+	u8 b;
+	rxframe_t f;
+
+	if(!flags.hanmode){
+		return  serio_read(s, p, size, deadline);
+
+	}
+
+	// The bytes come out of the serio receive buffer, which is filled with whatever the tty has in one read
+	f.state = FS_HUNT;
+	f.len = 0;
+	do{
+		if((res = serio_read(s, &b, 1, deadline)) != 1)
+			return (res < 0) ? res : 0;
+	}
+	while(!frame_decode(&f, b));
+
+	if(flags.cobs)
+		return cobs_decode(p, f.frame, f.len, size);
+	memcpy(p, f.frame, (f.len < size) ? f.len : size);
+	return f.len;
+}
+
+
+/* Zero out the packet buffer */
+
+static void packet_init(void)
+{
+	memset(packet.buffer, 0, sizeof(packet_t));
+	if(!flags.hanmode){
+		packet.pbl.id = STX;
+	}
+}
+
+/* Calculate CRC over the packet buffer minus the size of an u16, and store it in the last two bytes */
+
+static void packet_finalize(void)
+{	
+	u16 crc16;
+	crc16 = do_crc(0, packet.buffer, packet_txsize - sizeof(u16));
+	memcpy(packet.buffer + packet_txsize - sizeof(u16), &crc16, sizeof(u16));
+}
+
+
 /*
 * Unformat the packet return the length of the unformatted packet
 */
@@ -423,179 +975,1352 @@ static int packet_unformat(void *dest, void *src, int count)
 
 
 
-/* Send a command packet */
+/* Fill in the packet buffer with a command carrying nrows rows of payload and calculate its CRC */
 /* Note: Payload can be NULL if there is no payload to transmit */
 
-static int send_command(serioStuff *s, u8 cmd, u16 param, void *payload)
+static void packet_build_rows(u8 cmd, u16 param, u16 seq, void *payload, u8 nrows)
 {
-	int retries, res;
-	int bytes_sent, bytes_received;
-	u8 ack,nak;
-	unsigned char resp = 0x55; 
-	static u16 seqno = 0;
+	u16 crc16;
+	int rowbytes, plen;
 
+	rowbytes = ((cmd == BC_WRITE_PMP) || (cmd == BC_WRITE_PMWP) || (cmd == BC_WRITE_PMWPA) ||
+	(cmd == BC_WRITE_PMWPC) || (cmd == BC_WRITE_PMBP)) ? PACKED_ROW : LOADER_PAYLOAD;
 
 	packet_init();
 
+	if(cmd == BC_QUERY)
+		addru = 0; // The loader clears bits 16-23 of the word address on a query
+
 	if(flags.hanmode){
-		packet.han.pkttype = HDC;
+		packet.han.pkttype = (flags.shortpkt) ? HDS : HDC;
+		if(flags.fec)
+			packet.han.pkttype = (flags.shortpkt) ? HDSF : HDCF; // Tells the loader check bytes follow the CRC
 		packet.han.addr = (u8) hannodeaddr; 
 		packet.han.cmd = cmd;
 		packet.han.param = param;
-		packet.han.seq = seqno;
-		ack = HDC_ACK;
-		nak = HDC_NAK;
-		
+		packet.han.seq = seq;
+	}
+	else{
+		packet.pbl.cmd = cmd;
+		packet.pbl.param = param;
+		packet.pbl.seq = seq;
+	}
+	if(flags.shortpkt){
+		// Short packet: payload length after the header, then only the payload bytes used
+		plen = (payload) ? nrows * rowbytes : 0;
+		if(nrows == 1){
+			while(plen && !((u8 *) payload)[plen - 1])
+				plen--; // The loader zero fills a single row
+		}
+		packet.buffer[SHORT_LEN] = (u8) plen;
+		if(plen)
+			memcpy(packet.buffer + SHORT_LEN + 1, payload, plen);
+		packet_txsize = SHORT_OVERHEAD + plen;
+	}
+	else{
+		packet_txsize = packet_size - LOADER_PAYLOAD + (nrows * rowbytes);
+		if(payload)
+			memcpy(packet.buffer + ((flags.hanmode) ? offsetof(packet_t_han, payload) : offsetof(packet_t_pbl, payload)),
+			payload, nrows * rowbytes);
+	}
+	packet_finalize();
+	memcpy(&crc16, packet.buffer + packet_txsize - sizeof(u16), sizeof(u16));
+	debug(DEBUG_ACTION,"Command: 0x%02X Sequence Number: %d, Rows: %u, CRC: 0x%04X", cmd, seq, nrows, crc16);
+	if(flags.fec)
+		packet_txsize += fec_encode(packet.buffer, packet_txsize);
+}
+
+/* Fill in the packet buffer with a single row command */
+
+static void packet_build(u8 cmd, u16 param, u16 seq, void *payload)
+{
+	packet_build_rows(cmd, param, seq, payload, 1);
+}
+
+/* Command in the packet buffer */
+
+static u8 packet_cmd(void)
+{
+	return (flags.hanmode) ? packet.han.cmd : packet.pbl.cmd;
+}
+
+
+/*
+* Timeout for the response to cmd, from its smoothed round trip time and deviation, doubled for each failure
+* since the last good round trip. Until cmd has been measured, initial is used.
+*/
+
+static long rtt_timeout(u8 cmd, long initial)
+{
+	rtt_t *r = rtts + cmd;
+	long rto = initial;
+
+	if(r->samples){
+		rto = (r->srtt >> 3) + r->rttvar;
+		if(rto < RTT_MIN_TIMEOUT)
+			rto = RTT_MIN_TIMEOUT;
+	}
+	rto <<= backoff;
+	return (rto > RTT_MAX_TIMEOUT) ? RTT_MAX_TIMEOUT : rto;
+}
+
+
+/*
+* Add a round trip of us microseconds to the estimate for cmd.
+* Only round trips of packets which were not resent should be added, or a late response could be counted
+* against the resend.
+*/
+
+static void rtt_sample(u8 cmd, long us)
+{
+	rtt_t *r = rtts + cmd;
+	long err;
+
+	if(!r->samples++){
+		r->srtt = us << 3;
+		r->rttvar = us << 1;
+	}
+	else{
+		err = us - (r->srtt >> 3);
+		r->srtt += err;
+		if(err < 0)
+			err = -err;
+		r->rttvar += err - (r->rttvar >> 2);
+	}
+	backoff = 0;
+	debug(DEBUG_ACTION, "Round trip: %ld us, smoothed: %ld us, timeout: %ld us", us, r->srtt >> 3, rtt_timeout(cmd, 0));
+}
+
+
+/* Note a failed exchange, so that the timeouts and retry delays double */
+
+static void rtt_backoff(void)
+{
+	if(backoff < RTT_MAX_BACKOFF)
+		backoff++;
+}
+
+
+/* Forget the round trip times, when the link has changed speed */
+
+static void rtt_reset(void)
+{
+	memset(rtts, 0, sizeof(rtts));
+	backoff = 0;
+}
+
+
+/*
+* Time to wait for cmd, before retrying it or while the loader carries it out: a smoothed round trip, or initial
+* until one is known, doubled for each failure
+*/
+
+static long rtt_delay(u8 cmd, long initial)
+{
+	rtt_t *r = rtts + cmd;
+	long delay = (r->samples) ? r->srtt >> 3 : initial;
+
+	delay <<= backoff;
+	return (delay > RTT_MAX_TIMEOUT) ? RTT_MAX_TIMEOUT : delay;
+}
+
+/*
+* Transmit the packet buffer, then wait for a response of rxlen bytes.
+* If rxlen is zero, no response is expected and we return as soon as the packet is sent.
+* The response timeout comes from the round trip times of the command, and the time the response took is left in rtt_last.
+*
+* Returns the number of response bytes received (0 on a time out), or FAIL on an I/O error.
+*/
+
+static int packet_exchange(serioStuff *s, u8 *resp, int rxlen)
+{
+	int res;
+	int bytes_sent, bytes_received;
+	long timeout;
+	struct timespec deadline;
+
+	rtt_last = 0;
+	if(!flags.handisrunning){ // Hand not running?
+		deadline_set(&deadline, SERIO_WAIT_WRITE_USEC_DELAY);
+		if((bytes_sent = packet_tx(s, packet.buffer, packet_txsize, &deadline)) < 0){
+			debug(DEBUG_ACTION, "Command Packet Write Error");
+			return FAIL;
+		}
+		debug(DEBUG_ACTION, "Bytes Sent: %d", bytes_sent);
+		if(bytes_sent != packet_txsize){
+			debug(DEBUG_ACTION, "Command Packet Write Incomplete");
+			return FAIL;
+		}
+		if(flags.rs485)
+			serio_drain(s); // Time the response from when the bus turns round
+		if(!rxlen)
+			return 0;
+
+		// The response bytes are not framed, take them straight from the serio receive buffer
+		timeout = rtt_timeout(packet_cmd(), SERIO_WAIT_READ_USEC_DELAY);
+		deadline_set(&deadline, timeout);
+		if((bytes_received = serio_read(s, resp, rxlen, &deadline)) < 0){
+			debug(DEBUG_UNEXPECTED, "Response Read Error: %s", strerror(errno));
+			return FAIL;
+		}
+		if(bytes_received == rxlen)
+			rtt_last = timeout - deadline_left(&deadline);
+		debug(DEBUG_ACTION, "Response after %ld of %ld us", timeout - deadline_left(&deadline), timeout);
+		return bytes_received;
+	}
+	else{ // Hand is running
+		client_command.cmd.raw.txlen = packet_format(client_command.cmd.raw.txbuffer, &packet.han, packet_txsize);
+		client_command.cmd.raw.rxexpectlen = rxlen;
+		client_command.cmd.raw.txtimeout = 100000;
+		client_command.cmd.raw.rxtimeout = timeout = rtt_timeout(packet_cmd(), 1000000);
+		client_command.request = HAN_CCMD_RAW_PACKET;
+		deadline_set(&deadline, timeout);
+		res = hanclient_send_command_return_res(&client_command);
+		if(res)
+			return 0;
+		bytes_received = client_command.cmd.raw.rxexpectlen;
+		if(bytes_received > rxlen)
+			bytes_received = rxlen;
+		if(bytes_received == rxlen)
+			rtt_last = timeout - deadline_left(&deadline); // Includes the trip through hand
+		memcpy(resp, client_command.cmd.raw.rxbuffer, bytes_received);
+		return bytes_received;
+	}
+}
+
+
+/*
+* Check a short packet of len bytes in the packet buffer, and expand it in place to a full packet
+* Returns the size of the full packet, or 0 if the short packet is bad.
+*/
+
+static int packet_expand(int len)
+{
+	int plen;
+	u16 crc16, rcrc16;
+
+	if(len < SHORT_OVERHEAD)
+		return 0;
+	plen = packet.buffer[SHORT_LEN];
+	if((len != SHORT_OVERHEAD + plen) || (plen > LOADER_PAYLOAD)){
+		debug(DEBUG_UNEXPECTED, "Short packet length error: %d bytes, payload length %d", len, plen);
+		return 0;
+	}
+	crc16 = do_crc(0, packet.buffer, len - sizeof(u16));
+	memcpy(&rcrc16, packet.buffer + len - sizeof(u16), sizeof(u16));
+	if(crc16 != rcrc16){
+		debug(DEBUG_UNEXPECTED, "Short packet CRC error");
+		return 0;
+	}
+	memmove(packet.han.payload, packet.buffer + SHORT_LEN + 1, plen);
+	memset(packet.han.payload + plen, 0, sizeof(packet_t_han) - offsetof(packet_t_han, payload) - plen);
+	packet.han.crc16 = do_crc(0, packet.buffer, packet_size - sizeof(u16));
+	return packet_size;
+}
+
+/* Calculate and check the packet CRC */
+
+static int packet_check()
+{
+	u16	rcrc16, crc16 =  do_crc(0, (u8 *) packet.buffer, packet_size - sizeof(u16));
+
+	rcrc16 = (flags.hanmode) ? packet.han.crc16 : packet.pbl.crc16;
+
+	debug(DEBUG_ACTION, "Rx CRC: 0x%04X, Calc CRC 0x%04X", rcrc16, crc16);
+
+	if(crc16 == rcrc16)
+		return PASS;
+	else
+		return FAIL;
+		
+}
+
+
+/*
+* Transmit the packet buffer, and wait for a response packet which replaces it.
+* This is used for commands which return data instead of an ACK, such as BC_QUERY.
+*
+* Returns PASS if a response packet with a good CRC was received, else FAIL.
+*/
+
+static int packet_request(serioStuff *s, int tries, int timeout)
+{
+	int i, res, crcerr;
+	int bytes_sent, bytes_received;
+	u8 cmd;
+	long rxtimeout;
+	packet_t txpacket;
+	struct timespec deadline;
+
+	txpacket = packet; // Keep a copy for retries, the response overwrites the packet buffer
+	cmd = packet_cmd();
+
+	for(i = 0; i < tries; i++){
+		packet = txpacket;
+		if(!flags.handisrunning){
+			serio_flush_input(s);
+			deadline_set(&deadline, timeout);
+			if((bytes_sent = packet_tx(s, packet.buffer, packet_txsize, &deadline)) < 0){
+				debug(DEBUG_UNEXPECTED, "Packet write error");
+				return FAIL;
+			}
+			debug(DEBUG_ACTION, "Bytes Sent: %d", bytes_sent);
+			if(bytes_sent != packet_txsize){
+				debug(DEBUG_UNEXPECTED, "Packet write incomplete");
+				return FAIL;
+			}
+			if(flags.rs485)
+				serio_drain(s); // Time the response from when the bus turns round
+
+			packet_init(); // Just to be sure we get something
+
+			// Wait for response, the whole frame has to be in by the deadline
+			rxtimeout = rtt_timeout(cmd, timeout);
+			deadline_set(&deadline, rxtimeout);
+			bytes_received = packet_rx(s, packet.buffer, packet_size, &deadline);
+			debug(DEBUG_ACTION, "Bytes Received: %d after %ld of %ld us", bytes_received, rxtimeout - deadline_left(&deadline), rxtimeout);
+			if(bytes_received < 0){
+				debug(DEBUG_UNEXPECTED, "Packet read error");
+				return FAIL;
+			}
+		}
+		else{ // Send packets through hand
+			client_command.cmd.raw.txlen = packet_format(client_command.cmd.raw.txbuffer, &packet.han, packet_txsize);
+			client_command.cmd.raw.rxexpectlen = 255;
+			client_command.cmd.raw.txtimeout = 100000;
+			client_command.cmd.raw.rxtimeout = rxtimeout = rtt_timeout(cmd, (timeout < HAND_RX_TIMEOUT) ? timeout : HAND_RX_TIMEOUT);
+			client_command.request = HAN_CCMD_RAW_PACKET;
+			deadline_set(&deadline, rxtimeout);
+			res = hanclient_send_command_return_res(&client_command);
+			if((!res) && (client_command.cmd.raw.rxexpectlen))
+				bytes_received = packet_unformat(packet.buffer, client_command.cmd.raw.rxbuffer, 255);
+			else
+				bytes_received = 0;
+		}
+		if(flags.shortpkt && (bytes_received > 0))
+			bytes_received = packet_expand(bytes_received);
+		if(bytes_received)
+			crcerr = packet_check();
+		else
+			crcerr = 0;
+		if((bytes_received == packet_size) && (!crcerr)){ // Must see a packet with a good CRC, not just an ACK
+			if(!i)
+				rtt_sample(cmd, rxtimeout - deadline_left(&deadline));
+			return PASS;
+		}
+		rtt_backoff();
+		debug(DEBUG_UNEXPECTED,"Response packet receive error, try = %d", i);
+		debug(DEBUG_UNEXPECTED,"bytes_received = %d crcerr = %d", bytes_received, crcerr);
+	}
+	debug(DEBUG_EXPECTED, "Too many packet retries!");
+	return FAIL;
+}
+
+
+/* Return true if the query packet asked for option opt */
+
+static int query_opt(u8 opt)
+{
+	return ((queryparam & 0xFF00) == QUERY_OPTS) && (queryparam & opt);
+}
+
+
+/*
+* Read the rest of a NAK with a reason, got bytes of which are already in buf.
+* Returns the reason code, and the sequence number the loader expects in *expected, or 0 if the NAK was cut short.
+*/
+
+static u8 nak_reason(serioStuff *s, u8 *buf, int got, u16 *expected)
+{
+	int res;
+	struct timespec deadline;
+
+	deadline_set(&deadline, SERIO_WAIT_READ_USEC_DELAY);
+	if((got < NAK_SIZE) && ((res = serio_read(s, buf + got, NAK_SIZE - got, &deadline)) > 0))
+		got += res;
+	if(got != NAK_SIZE){
+		debug(DEBUG_UNEXPECTED, "NAK reason lost");
+		return 0;
+	}
+	*expected = buf[2] | (((u16) buf[3]) << 8);
+	debug(DEBUG_UNEXPECTED, "NAK: %s, expected sequence number: %u", nak_reasons[(buf[1] <= NR_CMD) ? buf[1] : 0], *expected);
+	return buf[1];
+}
+
+
+/* Send a command packet carrying nrows rows of payload */
+/* Note: Payload can be NULL if there is no payload to transmit */
+
+static int send_command_rows(serioStuff *s, u8 cmd, u16 param, void *payload, u8 nrows)
+{
+	int retries, tries;
+	int bytes_received;
+	u8 ack,nak,reason;
+	u8 resp = 0x55; 
+	u8 nakbuf[NAK_SIZE];
+	u16 expected;
+
+	if(flags.hanmode){
+		ack = HDC_ACK;
+		nak = HDC_NAK;
+	}
+	else{
+		ack = ACK;
+		nak = NAK;
+	}
+	tries = (flags.handisrunning) ? PACKET_RETRIES : PACKET_RETRIES + 1; // Serially, the first send is not a retry
+
+	packet_build_rows(cmd, param, seqno, payload, nrows);
+
+	if(!flags.handisrunning)
+		serio_flush_input(s);
+
+	for(retries = 0; retries < tries; retries++){
+		if((bytes_received = packet_exchange(s, &resp, 1)) < 0)
+			return FAIL;
+
+		if(bytes_received != 1){
+			rtt_backoff();
+			if(!flags.handisrunning){
+				debug(DEBUG_ACTION, "Read Timeout Error");
+				return FAIL;
+			}
+			debug(DEBUG_UNEXPECTED,"Received invalid or no response, try = %d", retries);
+			usleep(rtt_delay(cmd, RETRY_DELAY));
+			continue;
+		}
+
+		if((resp == ack)||(resp == nak)){
+			debug(DEBUG_ACTION, "Response: %s",(resp == ack)?"ACK":"NAK");
+		}
+		else{
+			debug(DEBUG_ACTION, "Response: 0x%02X", (unsigned int) resp);
+		}
+
+		if(((cmd == BC_CHECK_APP) || (cmd == BC_CHECK_CRC) || (cmd == BC_WRITE_PMC) || (cmd == BC_CHECK_EXEC)) && (resp == STX)){
+			debug(DEBUG_UNEXPECTED, "Check App Failed");
+			return FAIL;
+		}
+
+		if(resp == ack){
+			if(!retries)
+				rtt_sample(cmd, rtt_last);
+			break; // Success
+		}
+
+		debug(DEBUG_ACTION, "Did not get ACK");
+		if((resp != nak) && (!flags.handisrunning))
+			return FAIL; // Didn't get ACK or NAK. Fail.
+		if(flags.nakreason){
+			nakbuf[0] = resp;
+			if(!(reason = nak_reason(s, nakbuf, 1, &expected))){
+				serio_flush_input(s);
+				continue;
+			}
+			if((reason == NR_SEQ) && (expected == (u16) (seqno + 1))){
+				debug(DEBUG_UNEXPECTED, "Packet was accepted, its ACK was lost");
+				break;
+			}
+			if((reason != NR_CRC) && (reason != NR_LENGTH))
+				return FAIL; // A resend would fail the same way
+			debug(DEBUG_UNEXPECTED, "***Resending packet***, try = %d", retries);
+			continue; // Damaged on the way, resend straight away
+		}
+		debug(DEBUG_UNEXPECTED, "***Retrying packet***, try = %d", retries);
+		rtt_backoff();
+		usleep(rtt_delay(cmd, RETRY_DELAY));
+	}
+	if(retries == tries){
+		debug(DEBUG_EXPECTED, "Too many packet retries!");
+		return FAIL;
+	}
+
+	seqno++;
+	return PASS;
+}
+
+/* Send a single row command packet */
+/* Note: Payload can be NULL if there is no payload to transmit */
+
+static int send_command(serioStuff *s, u8 cmd, u16 param, void *payload)
+{
+	return send_command_rows(s, cmd, param, payload, 1);
+}
+
+/*
+* Word addresses in packets are 16 bits. Before a command for a row above 64K words, bits 16-23 of its word address
+* are sent with BC_SET_ADDRU, if they differ from the ones the loader has.
+*/
+
+static int set_addru(serioStuff *s, u32 wordaddr)
+{
+	u8 u = (u8) (wordaddr >> 16);
+
+	if(u == addru)
+		return PASS;
+	debug(DEBUG_ACTION, "Set word address bits 16-23: 0x%02X", u);
+	if(send_command(s, BC_SET_ADDRU, u, NULL))
+		return FAIL;
+	addru = u;
+	return PASS;
+}
+
+/* Number of rows from wordaddr to the end of its 64K word page, so that no command crosses into the next */
+
+static u32 page_rows(u32 wordaddr)
+{
+	return (0x10000 - (wordaddr & 0xFFFF)) / (LOADER_PAYLOAD >> 1);
+}
+
+
+/* Return true if a row only contains the erase pattern */
+
+static int row_is_blank(u8 *row)
+{
+	int i;
+
+	for(i = 0; i < LOADER_PAYLOAD; i++){
+		if(row[i] != ((i & 1) ? 0x3F : 0xFF))
+			return 0;
+	}
+	return 1;
+}
+
+
+/* Erase count rows starting at wordaddr, ERASE_ROWS_MAX rows at a time */
+
+static int erase_rows(serioStuff *s, u32 wordaddr, u32 count)
+{
+	u32 n;
+	u8 pl[LOADER_PAYLOAD];
+
+	while(count){
+		n = (count > ERASE_ROWS_MAX) ? ERASE_ROWS_MAX : count;
+		if(n > page_rows(wordaddr))
+			n = page_rows(wordaddr);
+		if(set_addru(s, wordaddr))
+			return FAIL;
+		memset(pl, 0, LOADER_PAYLOAD);
+		pl[0] = (u8) n;
+		pl[1] = (u8) (n >> 8);
+		debug(DEBUG_ACTION, "Erase %u rows at wordaddr: 0x%06X", n, wordaddr);
+		if(send_command(s, BC_ERASE_PM, wordaddr, pl))
+			return FAIL;
+		wordaddr += n * (LOADER_PAYLOAD >> 1);
+		count -= n;
+	}
+	return PASS;
+}
+
+
+/* Copy count rows on the target, COPY_MAX rows at a time. dst and src hold word addresses */
+
+static int copy_rows(serioStuff *s, u16 *dst, u16 *src, u32 count)
+{
+	u32 i, n;
+	u8 pl[LOADER_PAYLOAD];
+
+	while(count){
+		n = (count > COPY_MAX) ? COPY_MAX : count;
+		memset(pl, 0, LOADER_PAYLOAD);
+		for(i = 0; i < n; i++){
+			debug(DEBUG_ACTION, "Copy wordaddr: 0x%04X to 0x%04X", src[i], dst[i]);
+			pl[i << 2] = (u8) dst[i];
+			pl[(i << 2) + 1] = (u8) (dst[i] >> 8);
+			pl[(i << 2) + 2] = (u8) src[i];
+			pl[(i << 2) + 3] = (u8) (src[i] >> 8);
+		}
+		if(send_command(s, BC_COPY_PM, (u16) n, pl))
+			return FAIL;
+		dst += n;
+		src += n;
+		count -= n;
+	}
+	return PASS;
+}
+
+
+/* Read the CRCs of count rows starting at wordaddr from the target, ROW_CRC_MAX rows at a time */
+
+static int read_row_crcs(serioStuff *s, u32 wordaddr, u32 count, u16 *crcs)
+{
+	u32 i, n;
+	u8 pl[LOADER_PAYLOAD];
+	u8 *rp;
+
+	while(count){
+		n = (count > ROW_CRC_MAX) ? ROW_CRC_MAX : count;
+		if(n > page_rows(wordaddr))
+			n = page_rows(wordaddr);
+		if(set_addru(s, wordaddr))
+			return FAIL;
+		memset(pl, 0, LOADER_PAYLOAD);
+		pl[0] = (u8) n;
+		debug(DEBUG_ACTION, "Read %u row CRCs at wordaddr: 0x%06X", n, wordaddr);
+		packet_build(BC_ROW_CRC, wordaddr, seqno, pl);
+		if(packet_request(s, PACKET_RETRIES, 5000000))
+			return FAIL;
+		if(((flags.hanmode) ? packet.han.param : packet.pbl.param) != (u16) wordaddr){
+			debug(DEBUG_UNEXPECTED, "Row CRC response is for the wrong address");
+			return FAIL;
+		}
+		rp = (flags.hanmode) ? packet.han.payload : packet.pbl.payload;
+		for(i = 0; i < n; i++)
+			*crcs++ = rp[i << 1] | (((u16) rp[(i << 1) + 1]) << 8);
+		wordaddr += n * (LOADER_PAYLOAD >> 1);
+		count -= n;
+	}
+	return PASS;
+}
+
+
+/* Read the CRCs of a list of rows from the target, a run of consecutive rows at a time */
+
+static int read_list_crcs(serioStuff *s, row_t *rows, u32 count, u16 *crcs)
+{
+	u32 i, n;
+
+	for(i = 0; i < count; i += n){
+		for(n = 1; (i + n < count) && (rows[i + n].wordaddr == rows[i].wordaddr + n * (LOADER_PAYLOAD >> 1)); n++);
+		if(read_row_crcs(s, rows[i].wordaddr, n, crcs + i))
+			return FAIL;
+	}
+	return PASS;
+}
+
+
+/* CRC of the addresses and data of a list of rows, which identifies the image in the journal */
+
+static u16 image_crc(row_t *rows, u32 count)
+{
+	u32 i;
+	u16 crc = 0;
+	u8 addr[3];
+
+	for(i = 0; i < count; i++){
+		addr[0] = (u8) rows[i].wordaddr;
+		addr[1] = (u8) (rows[i].wordaddr >> 8);
+		addr[2] = (u8) (rows[i].wordaddr >> 16);
+		crc = do_crc(crc, addr, 3);
+		crc = do_crc(crc, rows[i].data, LOADER_PAYLOAD);
+	}
+	return crc;
+}
+
+
+/*
+* Return the number of rows acknowledged in the last session with the node, if it was writing the same image,
+* else 0.
+*/
+
+static u32 journal_read(void)
+{
+	FILE *f;
+	unsigned imagecrc, nrows, acked;
+	int n;
+
+	if(!(f = fopen(journal.path, "r")))
+		return 0;
+	n = fscanf(f, "image %x rows %u acked %u", &imagecrc, &nrows, &acked);
+	fclose(f);
+	if((n != 3) || (imagecrc != journal.imagecrc) || (nrows != journal.nrows) || (acked >= nrows))
+		return 0;
+	return acked;
+}
+
+
+/*
+* Checkpoint the session in the journal every JOURNAL_ROWS rows, base is the number of rows write_rows()
+* has had acknowledged. The file is replaced in one go, so a crash cannot leave it half written.
+*/
+
+static void journal_update(u32 base)
+{
+	FILE *f;
+	char tmp[sizeof(journal.path) + 4];
+	u32 acked = journal.start + base;
+
+	if(!journal.path[0] || (acked < journal.acked + JOURNAL_ROWS))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", journal.path);
+	if(!(f = fopen(tmp, "w")) || (fprintf(f, "image %04X rows %u acked %u\n", journal.imagecrc, journal.nrows, acked) < 0) ||
+	fclose(f) || rename(tmp, journal.path)){
+		warn("Cannot write journal %s: %s", journal.path, strerror(errno));
+		journal.path[0] = 0;
+		return;
+	}
+	journal.acked = acked;
+}
+
+
+/* Drop the journal once all the rows are written */
+
+static void journal_remove(void)
+{
+	if(journal.path[0] && unlink(journal.path) && (errno != ENOENT))
+		warn("Cannot remove journal %s: %s", journal.path, strerror(errno));
+	journal.path[0] = 0;
+}
+
+
+/* Print a progress dot for each row written */
+
+static void show_progress(u32 rowsdone)
+{
+	if(debuglvl == DEBUG_UNEXPECTED){
+		printf(".");
+		if((rowsdone & 63) == 0)
+			printf("\n");
+		fflush(stdout);
+	}
+}
+
+
+/*
+* Wait for the boot loader to start after the entry command was sent, probing it with queries until it answers.
+* entry is the deadline set when the command was sent. Each probe waits long enough for the query and a fully
+* byte stuffed response to cross the bus at baud, and never less than hand is given for a query response.
+* Returns PASS with the query response in the packet buffer, or FAIL if the deadline passed first.
+*/
+
+static int wait_for_loader(serioStuff *s, struct timespec *entry, unsigned baud)
+{
+	int probes;
+	long left, timeout;
+	packet_t query;
+	struct timespec probe;
+
+	timeout = WIRE_TIME((packet_txsize + packet_size) * 2 + 4, baud) + ENTRY_PROBE_MARGIN;
+	if(flags.handisrunning && (timeout < HAND_RX_TIMEOUT))
+		timeout = HAND_RX_TIMEOUT;
+	debug(DEBUG_ACTION, "Query probe timeout: %ld us", timeout);
+
+	query = packet;
+	for(probes = 1; deadline_left(entry); probes++){
+		packet = query;
+		deadline_set(&probe, timeout);
+		if(!packet_request(s, 1, timeout)){
+			printf("OK, %ld ms\n", (ENTRY_TIMEOUT - deadline_left(entry)) / 1000);
+			debug(DEBUG_ACTION, "Boot loader answered query probe %d", probes);
+			return PASS;
+		}
+		rtt_reset(); // Probes lost while the node restarts say nothing about the round trip
+		if((left = deadline_left(&probe)))
+			usleep(left); // Failed early, don't flood the bus
+	}
+	printf("no answer\n");
+	return FAIL;
+}
+
+
+/*
+* Switch the loader and the serial port to the fastest baud rate the loader offers, up to maxbaud
+*
+* The loader ACKs BC_SET_BAUD at the old rate, then switches. The link is re-synced with BC_QUERY at the new rate.
+* If that fails, the loader falls back to its power up rate on its own, and so does the serial port. The same is done
+* when BC_SET_BAUD is not ACKed, as the loader may have switched and only its ACK was lost.
+* The query response is left in the packet buffer either way.
+*/
+
+static void change_baud(serioStuff *s, response_t *r, unsigned maxbaud, unsigned baudrate)
+{
+	unsigned rate, best = 0;
+	u8 i, index = 0;
+
+	if(!(r->caps & CAP_BAUD)){
+		warn("Boot loader cannot change baud rate, staying at %u baud", baudrate);
+		return;
+	}
+	for(i = 0; (i < MAX_BAUDS) && r->bauds[i]; i++){
+		rate = r->bauds[i] * 100;
+		if((rate <= maxbaud) && (rate > best)){
+			best = rate;
+			index = i;
+		}
+	}
+	if(best <= baudrate){
+		debug(DEBUG_ACTION, "No baud rate faster than %u offered up to %u", baudrate, maxbaud);
+		return;
+	}
+
+	debug(DEBUG_ACTION, "Switching to %u baud", best);
+	if(send_command(s, BC_SET_BAUD, index, NULL))
+		warn("Baud rate change not acknowledged"); // The loader may have switched and lost its ACK, resync below
+	else if(serio_set_baud(s, best))
+		warn("Serial port cannot be set to %u baud", best);
+	else{
+		rtt_reset();
+		packet_build(BC_QUERY, queryparam, 0, NULL);
+		if(!packet_request(s, 1, BAUD_SYNC_TIMEOUT)){
+			seqno = 0; // BC_QUERY resets the sequence number on the loader
+			if(flags.verbose)
+				printf("Baud rate           : %u\n", best);
+			return;
+		}
+		warn("No response at %u baud", best);
+	}
+
+	/* Fall back to the original rate, and re-sync */
+
+	usleep(BAUD_FALLBACK_DELAY);
+	if(serio_set_baud(s, baudrate))
+		fatal("Serial port cannot be set back to %u baud", baudrate);
+	rtt_reset();
+	packet_build(BC_QUERY, queryparam, 0, NULL);
+	if(packet_request(s, PACKET_RETRIES, 5000000))
+		fatal("No valid response to query packet after falling back to %u baud", baudrate);
+	seqno = 0;
+	warn("Fell back to %u baud", baudrate);
+}
+
+
+/* Return word n of a list of consecutive rows */
+
+static u16 row_word(row_t *rows, u32 n)
+{
+	u8 *p = rows[n / (LOADER_PAYLOAD >> 1)].data + ((n % (LOADER_PAYLOAD >> 1)) << 1);
+
+	return p[0] | (((u16) p[1]) << 8);
+}
+
+
+/*
+* Run length code count consecutive rows into a BC_WRITE_PMZ payload
+*
+* The first payload byte is the row count. A token with RLE_RUN set is followed by one word which is repeated
+* (token & 0x7F) + 1 times. Otherwise the token is followed by token + 1 literal words.
+* Returns the number of payload bytes used, or 0 if the rows do not fit.
+*/
+
+static int rle_encode(u8 *payload, row_t *rows, u32 count)
+{
+	u32 words = count * (LOADER_PAYLOAD >> 1);
+	u32 i, run, lit, littok, pos;
+	u16 w;
+
+	memset(payload, 0, LOADER_PAYLOAD);
+	payload[0] = (u8) count;
+	for(i = 0, pos = 1, lit = 0, littok = 0; i < words;){
+		w = row_word(rows, i);
+		for(run = 1; (i + run < words) && (run < RLE_RUN) && (row_word(rows, i + run) == w); run++);
+		if(run > 1){
+			if(pos + 3 > LOADER_PAYLOAD)
+				return 0;
+			payload[pos++] = (u8) (RLE_RUN | (run - 1));
+			payload[pos++] = (u8) w;
+			payload[pos++] = (u8) (w >> 8);
+			i += run;
+			lit = 0;
+			continue;
+		}
+		if((!lit) || (lit == RLE_RUN)){ // Start a new literal token
+			if(pos + 3 > LOADER_PAYLOAD)
+				return 0;
+			littok = pos++;
+			lit = 0;
+		}
+		else if(pos + 2 > LOADER_PAYLOAD)
+			return 0;
+		payload[littok] = (u8) lit++;
+		payload[pos++] = (u8) w;
+		payload[pos++] = (u8) (w >> 8);
+		i++;
+	}
+	return pos;
+}
+
+
+/* Return how many consecutive rows at the start of the list fit in one BC_WRITE_PMZ packet */
+
+static u32 rle_rows(row_t *rows, u32 count)
+{
+	u8 payload[LOADER_PAYLOAD];
+	u32 n;
+
+	for(n = 0; (n < count) && (n < RLE_ROWS_MAX); n++){
+		if(n && ((rows[n].wordaddr != rows[n - 1].wordaddr + (LOADER_PAYLOAD >> 1)) || !SAME_PAGE(rows[n].wordaddr, rows[0].wordaddr)))
+			break;
+		if(!rle_encode(payload, rows, n + 1))
+			break;
+	}
+	return n;
+}
+
+
+/*
+* Return the number of rows at the start of the list which can be sent in one write packet: up to max rows
+* at consecutive addresses (step apart), ending before a row which starts a run of run length coded rows.
+* The first row is always taken.
+*/
+
+static u32 packet_group(row_t *rows, u32 count, u32 max, u16 step, u8 rle)
+{
+	u32 n;
+
+	for(n = 1; (n < count) && (n < max); n++){
+		if((rows[n].wordaddr != rows[n - 1].wordaddr + step) || !SAME_PAGE(rows[n].wordaddr, rows[0].wordaddr))
+			break;
+		if(rle && (rle_rows(rows + n, count - n) > 1))
+			break;
+	}
+	return n;
+}
+
+/*
+* Pack the words of count rows into a packet payload, 14 bits per word, least significant bits first.
+* Returns FAIL if a word does not fit in 14 bits.
+*/
+
+static int pack_rows(u8 *payload, row_t *rows, u32 count)
+{
+	u32 i, n, acc, bits;
+	u16 w;
+
+	for(i = 0; i < count; i++){
+		for(n = 0, acc = 0, bits = 0; n < (LOADER_PAYLOAD >> 1); n++){
+			w = rows[i].data[n << 1] | (((u16) rows[i].data[(n << 1) + 1]) << 8);
+			if(w > 0x3FFF)
+				return FAIL;
+			acc |= ((u32) w) << bits;
+			for(bits += 14; bits >= 8; bits -= 8){
+				*payload++ = (u8) acc;
+				acc >>= 8;
+			}
+		}
+	}
+	return PASS;
+}
+
+/*
+* Fill in the payload of a write packet with count rows, 14 bit packed if pack is set and the words allow it.
+* Returns the command to send, writecmd or its packed version.
+*/
+
+static u8 gather_rows(u8 *payload, row_t *rows, u32 count, u8 writecmd, u8 pack)
+{
+	u32 i;
+
+	if(pack && !pack_rows(payload, rows, count)){
+		switch(writecmd){
+			case BC_WRITE_PM:
+				return BC_WRITE_PMP;
+			case BC_WRITE_PMW:
+				return BC_WRITE_PMWP;
+			case BC_WRITE_PMWA:
+				return BC_WRITE_PMWPA;
+			case BC_WRITE_PMWC:
+				return BC_WRITE_PMWPC;
+			case BC_WRITE_PMB:
+				return BC_WRITE_PMBP;
+		}
+	}
+	for(i = 0; i < count; i++)
+		memcpy(payload + (i * LOADER_PAYLOAD), rows[i].data, LOADER_PAYLOAD);
+	return writecmd;
+}
+
+/*
+* Write a list of rows to the target
+*
+* If rle is set, runs of consecutive rows which run length code into a single packet are sent with BC_WRITE_PMZ,
+* and acknowledged individually.
+*
+* Other rows are sent up to packet_rows consecutive rows per packet. Program memory rows are grouped by word
+* address, EEPROM rows by byte address. If pack is set, program memory rows are sent 14 bit packed.
+*
+* If window is less than 2, each packet is sent with send_command_rows() and acknowledged individually.
+*
+* Otherwise, up to window rows are sent back to back with BC_WRITE_PMW. The last packet in the window is sent
+* with BC_WRITE_PMWA, which tells the loader to commit the rows it buffered and return a cumulative ACK carrying
+* the sequence number of the last packet it accepted. If there was a gap, the next window starts at the first
+* unacknowledged packet (go back N).
+*/
+
+static int write_rows(serioStuff *s, u8 writecmd, row_t *rows, u32 count, u8 window, u8 rle, u8 pack)
+{
+	u32 base, i, n, k, rlerows, rlepackets, rowpackets, packedrows;
+	u8 cmd = writecmd;
+	u16 acked, lastgood, step, expected;
+	int retries;
+	int bytes_received = 0;
+	u8 ack, nak;
+	u8 resp[NAK_SIZE];
+	u8 payload[MAX_PACKET_ROWS * LOADER_PAYLOAD];
+	u8 pktrows[MAX_WINDOW];
+	u8 pktpacked[MAX_WINDOW];
+	u32 npkts;
+
+	if(flags.hanmode){
+		ack = HDC_ACK;
+		nak = HDC_NAK;
+	}
+	else{
+		ack = ACK;
+		nak = NAK;
+	}
+	step = (writecmd == BC_WRITE_EEPROM) ? LOADER_PAYLOAD : (LOADER_PAYLOAD >> 1);
+
+	for(base = 0, retries = 0, rlerows = 0, rlepackets = 0, rowpackets = 0, packedrows = 0; base < count;){
+		journal_update(base);
+		if(set_addru(s, rows[base].wordaddr))
+			return FAIL;
+		if(rle && ((n = rle_rows(rows + base, count - base)) > 1)){
+			debug(DEBUG_ACTION, "wordaddr: 0x%04X, %u run length coded rows", rows[base].wordaddr, n);
+			rle_encode(payload, rows + base, n);
+			if(send_command(s, BC_WRITE_PMZ, rows[base].wordaddr, payload))
+				return FAIL;
+			rlerows += n;
+			rlepackets++;
+			for(i = 0; i < n; i++)
+				show_progress(++base);
+			continue;
+		}
+
+		if(window < 2){
+			n = packet_group(rows + base, count - base, packet_rows, step, rle);
+			debug(DEBUG_ACTION, "wordaddr: 0x%04X, %u rows", rows[base].wordaddr, n);
+			cmd = gather_rows(payload, rows + base, n, writecmd, pack);
+			if(send_command_rows(s, cmd, rows[base].wordaddr, payload, (u8) n))
+				return FAIL;
+			rowpackets++;
+			if(cmd != writecmd)
+				packedrows += n;
+			for(i = 0; i < n; i++)
+				show_progress(++base);
+			continue;
+		}
+
+		// Group the rows into packets until the window is full
+		for(n = 0, npkts = 0; (base + n < count) && (n < window); npkts++){
+			// End the window before rows which can be run length coded, or are in the next 64K words
+			if(n && ((rle && (rle_rows(rows + base + n, count - base - n) > 1)) || !SAME_PAGE(rows[base + n].wordaddr, rows[base].wordaddr)))
+				break;
+			k = packet_group(rows + base + n, count - base - n, (window - n < packet_rows) ? window - n : packet_rows, step, rle);
+			pktrows[npkts] = (u8) k;
+			n += k;
+		}
+
+		if(!flags.handisrunning)
+			serio_flush_input(s);
+
+		for(i = 0, k = 0; i < npkts; k += pktrows[i++]){
+			debug(DEBUG_ACTION, "wordaddr: 0x%04X, %u rows", rows[base + k].wordaddr, pktrows[i]);
+			cmd = gather_rows(payload, rows + base + k, pktrows[i], (i == npkts - 1) ? BC_WRITE_PMWA : BC_WRITE_PMW, pack);
+			packet_build_rows(cmd, rows[base + k].wordaddr, (u16) (seqno + i), payload, pktrows[i]);
+			pktpacked[i] = (cmd == BC_WRITE_PMWP) || (cmd == BC_WRITE_PMWPA);
+			if((bytes_received = packet_exchange(s, resp, (i == npkts - 1) ? WACK_SIZE : 0)) < 0)
+				return FAIL;
+		}
+
+		acked = 0;
+		if((bytes_received == WACK_SIZE) && (resp[0] == ack)){
+			lastgood = resp[1] | (((u16) resp[2]) << 8);
+			acked = (u16) (lastgood + 1 - seqno);
+			debug(DEBUG_ACTION, "Cumulative ACK: last good sequence number: %u, packets acknowledged: %u", lastgood, acked);
+			if(acked > npkts){
+				debug(DEBUG_UNEXPECTED, "Cumulative ACK out of window");
+				acked = 0;
+			}
+		}
+		else if(bytes_received && (resp[0] == nak) && flags.nakreason){
+			// The end of the window was damaged. Nothing in it was committed, the loader tells where it is at.
+			switch(nak_reason(s, resp, bytes_received, &expected)){
+				case NR_CRC:
+				case NR_LENGTH:
+					acked = (u16) (expected - seqno);
+					if(acked > npkts)
+						acked = 0;
+					break;
+				case 0:
+					serio_flush_input(s);
+					break;
+				default:
+					return FAIL;
+			}
+		}
+		else if(bytes_received){
+			debug(DEBUG_ACTION, "Response: 0x%02X", (unsigned int) resp[0]);
+		}
+		else{
+			debug(DEBUG_ACTION, "Read Timeout Error");
+		}
+
+		for(i = 0; i < acked; i++){
+			if(pktpacked[i])
+				packedrows += pktrows[i];
+			for(k = 0; k < pktrows[i]; k++)
+				show_progress(++base);
+		}
+		seqno += acked;
+		rowpackets += acked;
+
+		if(acked == npkts){
+			if((!retries) && rtt_last)
+				rtt_sample(cmd, rtt_last); // Round trip of the window's last packet, programming included
+			retries = 0;
+			continue;
+		}
+		rtt_backoff();
+		if(++retries > PACKET_RETRIES){
+			debug(DEBUG_EXPECTED, "Too many packet retries!");
+			return FAIL;
+		}
+		debug(DEBUG_UNEXPECTED, "***Resending from row %u***, try = %d", base, retries);
+	}
+	if(rlepackets && flags.verbose)
+		printf("\n%u rows sent in %u run length coded packets\n", rlerows, rlepackets);
+	if((packet_rows > 1) && flags.verbose)
+		printf("\n%u rows sent in %u write packets\n", count - rlerows, rowpackets);
+	if(packedrows && flags.verbose)
+		printf("\n%u rows sent 14 bit packed\n", packedrows);
+	return PASS;
+}
+
+/* Make n the node packets are sent to, each node keeps its own sequence number */
+
+static void node_select(node_t *n)
+{
+	curnode->seqno = seqno;
+	curnode = n;
+	hannodeaddr = n->addr;
+	seqno = n->seqno;
+}
+
+/*
+* Query the nodes after the first one, and check they run the same boot loader as the first one, whose query
+* response r points to. The first node is selected again, and its query response is put back in the packet buffer.
+*/
+
+static void query_nodes(serioStuff *s, response_t *r)
+{
+	int i;
+	packet_t query = packet;
+	response_t ref = *r;
+	flags_t saved = flags;
+
+	flags.cobs = flags.shortpkt = flags.fec = 0; // Query the way the first node was queried
+	for(i = 1; i < nnodes; i++){
+		node_select(nodes + i);
+		packet_build(BC_QUERY, queryparam, 0, NULL);
+		if(packet_request(s, PACKET_RETRIES, 5000000))
+			fatal("No valid response to query packet from node 0x%02X", hannodeaddr);
+		seqno = 0; // BC_QUERY resets the sequence number on the loader
+		if((r->prodid != ref.prodid) || (r->bootvers != ref.bootvers) || (r->proto != ref.proto) ||
+		(r->window != ref.window) || (r->caps != ref.caps) || (r->caps2 != ref.caps2) || (r->maxrows != ref.maxrows) ||
+		(r->lsize != ref.lsize) || (r->appsize != ref.appsize))
+			fatal("Node 0x%02X does not run the same boot loader as node 0x%02X", hannodeaddr, nodes[0].addr);
 	}
-	else{
-		packet.pbl.cmd = cmd;
-		packet.pbl.param = param;
-		packet.pbl.seq = seqno;
-		ack = ACK;
-		nak = NAK;
+	node_select(nodes);
+	flags = saved;
+	packet = query;
+}
+
+/*
+* Write the same rows to all the nodes, interleaved
+*
+* Each node with rows left is sent a window of up to window rows, the last packet being BC_WRITE_PMWC. The loader
+* programs the rows without a response, while the next node is sent its window. Once every node has had its window,
+* each one is asked for its cumulative ACK with BC_POLL, after giving it time to finish programming. The bytes a node
+* misses while it programs are in other nodes' frames, and it is back in step by the next frame delimiter. A node
+* which missed packets gets them again in its next window (go back N), the others carry on.
+*/
+
+static int write_interleaved(serioStuff *s, row_t *rows, u32 count, u8 window, u8 pack)
+{
+	u32 i, k, n, done;
+	int active, bytes_received;
+	u8 cmd = BC_WRITE_PMWC; // Every window ends with one
+	u8 ack;
+	u16 acked, lastgood;
+	u8 resp[WACK_SIZE];
+	u8 payload[MAX_PACKET_ROWS * LOADER_PAYLOAD];
+	node_t *nd;
+	long wait;
+
+	ack = (flags.hanmode) ? HDC_ACK : ACK;
+	for(nd = nodes; nd < nodes + nnodes; nd++){
+		nd->base = 0;
+		nd->npkts = 0;
+		nd->retries = 0;
 	}
-	if(payload)
-		memcpy((flags.hanmode) ? packet.han.payload : packet.pbl.payload, payload, LOADER_PAYLOAD);
-	packet_finalize();
-	debug(DEBUG_ACTION,"Command: 0x%02X Sequence Number: %d, CRC: 0x%04X", cmd, seqno, (flags.hanmode)? packet.han.crc16 : packet.pbl.crc16);
 
-	if(!flags.handisrunning){ // Hand not running?
-		serio_flush_input(s);
-		for(retries = PACKET_RETRIES;;){
-			if((bytes_sent = packet_tx(s, packet.buffer, packet_size, 5000000)) < 0){
-				debug(DEBUG_ACTION, "Command Packet Write Error");
-				return FAIL;
+	for(active = nnodes, done = 0; active;){
+		// Send each node with rows left its next window
+		for(nd = nodes; nd < nodes + nnodes; nd++){
+			if(nd->base >= count)
+				continue;
+			node_select(nd);
+			for(n = 0, nd->npkts = 0; (nd->base + n < count) && (n < window); nd->npkts++){
+				k = packet_group(rows + nd->base + n, count - nd->base - n,
+				(window - n < packet_rows) ? window - n : packet_rows, LOADER_PAYLOAD >> 1, 0);
+				nd->pktrows[nd->npkts] = (u8) k;
+				n += k;
 			}
-			debug(DEBUG_ACTION, "Bytes Sent: %d", bytes_sent);
-			if(bytes_sent != packet_size){
-				debug(DEBUG_ACTION, "Command Packet Write Incomplete");
-				return FAIL;
+			for(i = 0, k = 0; i < nd->npkts; k += nd->pktrows[i++]){
+				debug(DEBUG_ACTION, "Node 0x%02X, wordaddr: 0x%04X, %u rows", nd->addr, rows[nd->base + k].wordaddr, nd->pktrows[i]);
+				cmd = gather_rows(payload, rows + nd->base + k, nd->pktrows[i],
+				(i == nd->npkts - 1) ? BC_WRITE_PMWC : BC_WRITE_PMW, pack);
+				packet_build_rows(cmd, rows[nd->base + k].wordaddr, (u16) (seqno + i), payload, nd->pktrows[i]);
+				if(packet_exchange(s, NULL, 0) < 0)
+					return FAIL;
 			}
+			serio_drain(s);
+			deadline_set(&nd->ready, rtt_delay(cmd, n * ROW_PROGRAM_TIME));
+		}
 
-			for(;;){
-				bytes_received = serio_read(s, &resp, 1, 5000000);
-				if(bytes_received < 0){
-					if(errno != EAGAIN){
-						debug(DEBUG_UNEXPECTED, "Response Read Error: %s", strerror(errno));
-						return FAIL;
-					}
-					else{
-						continue;
-					}
-				}
-				else{
-					break;
+		// Collect the cumulative ACKs
+		for(nd = nodes; nd < nodes + nnodes; nd++){
+			if(!nd->npkts)
+				continue;
+			node_select(nd);
+			if((wait = deadline_left(&nd->ready)))
+				usleep(wait); // Still programming, and not listening
+			serio_flush_input(s);
+			packet_build(BC_POLL, 0, seqno, NULL);
+			if((bytes_received = packet_exchange(s, resp, WACK_SIZE)) < 0)
+				return FAIL;
+
+			acked = 0;
+			if((bytes_received == WACK_SIZE) && (resp[0] == ack)){
+				lastgood = resp[1] | (((u16) resp[2]) << 8);
+				acked = (u16) (lastgood + 1 - seqno);
+				debug(DEBUG_ACTION, "Node 0x%02X, cumulative ACK: last good sequence number: %u, packets acknowledged: %u",
+				nd->addr, lastgood, acked);
+				if(acked > nd->npkts){
+					debug(DEBUG_UNEXPECTED, "Cumulative ACK out of window");
+					acked = 0;
 				}
 			}
-	
-			if(bytes_received != 1){
-				debug(DEBUG_ACTION, "Read Timeout Error");
-				return FAIL;
+			else
+				debug(DEBUG_ACTION, "Node 0x%02X, no cumulative ACK", nd->addr);
+
+			for(i = 0; i < acked; i++){
+				for(k = 0; k < nd->pktrows[i]; k++, nd->base++)
+					show_progress(++done);
 			}
+			seqno += acked;
 
-			if((resp == ack)||(resp == nak)){
-				debug(DEBUG_ACTION, "Response: %s",(resp == ack)?"ACK":"NAK");
+			if(acked == nd->npkts){
+				if((!nd->retries) && rtt_last)
+					rtt_sample(BC_POLL, rtt_last);
+				nd->retries = 0;
+			}
+			else if(++nd->retries > PACKET_RETRIES){
+				debug(DEBUG_EXPECTED, "Node 0x%02X, too many packet retries!", nd->addr);
+				return FAIL;
 			}
 			else{
-				debug(DEBUG_ACTION, "Response: 0x%02X", (unsigned int) resp);
+				rtt_backoff();
+				debug(DEBUG_UNEXPECTED, "***Node 0x%02X, resending from row %u***, try = %d", nd->addr, nd->base, nd->retries);
 			}
+			nd->npkts = 0;
+			if(nd->base >= count)
+				active--;
+		}
+	}
+	node_select(nodes);
+	if(flags.verbose)
+		printf("\n%u rows written to each of %u nodes\n", count, nnodes);
+	return PASS;
+}
 
-			if((cmd == BC_CHECK_APP) && (resp == STX)){
-				debug(DEBUG_UNEXPECTED, "Check App Failed");
-				return FAIL;
-			}
+/*
+* Write rows to every node of the product at once, with BC_WRITE_PMB
+*
+* The nodes do not respond, so after each packet has gone out, the time the nodes take to program its rows is waited
+* out before sending the next one. Rows a node missed are rewritten by repair_nodes() afterwards.
+*/
 
-			if((resp != ack)){				
-				debug(DEBUG_ACTION, "Did not get ACK");
-				if((resp == nak) && (retries--)){
-					debug(DEBUG_UNEXPECTED, "***Retrying packet***");
-					usleep(100000);
-					continue;
-				}
-				return FAIL; // Retries used up or didn't get ACK or NAK. Fail.
-			}
+static int write_broadcast(serioStuff *s, row_t *rows, u32 count, u8 pack)
+{
+	u32 base, i, n;
+	u8 cmd;
+	int res = PASS;
+	u8 payload[MAX_PACKET_ROWS * LOADER_PAYLOAD];
+
+	hannodeaddr = BROADCAST_ADDR;
+	for(base = 0; base < count; base += n){
+		n = packet_group(rows + base, count - base, packet_rows, LOADER_PAYLOAD >> 1, 0);
+		debug(DEBUG_ACTION, "Broadcast wordaddr: 0x%04X, %u rows", rows[base].wordaddr, n);
+		cmd = gather_rows(payload, rows + base, n, BC_WRITE_PMB, pack);
+		packet_build_rows(cmd, rows[base].wordaddr, productid, payload, (u8) n);
+		if(packet_exchange(s, NULL, 0) < 0){
+			res = FAIL;
 			break;
 		}
+		serio_drain(s);
+		usleep(rtt_delay(cmd, n * ROW_PROGRAM_TIME));
+		for(i = 1; i <= n; i++)
+			show_progress(base + i);
 	}
-	else{ // Hand is running
-		for(retries = 0; retries < PACKET_RETRIES; retries++){
-			client_command.cmd.raw.txlen = packet_format(client_command.cmd.raw.txbuffer, &packet.han, packet_size);
-			client_command.cmd.raw.rxexpectlen = 1;
-			client_command.cmd.raw.txtimeout = 100000;
-			client_command.cmd.raw.rxtimeout = 1000000;
-			client_command.request = HAN_CCMD_RAW_PACKET;
-			res = hanclient_send_command_return_res(&client_command);
-			bytes_received = 0;
-			if(!res)
-				bytes_received = client_command.cmd.raw.rxexpectlen;
-			if(bytes_received == 1){
-				resp = client_command.cmd.raw.rxbuffer[0];
-				if((resp == ack)||(resp == nak)){
-					debug(DEBUG_ACTION, "Response: %s",(resp == ack)?"ACK":"NAK");
-				}
-				else{
-					debug(DEBUG_ACTION, "Response: 0x%02X", (unsigned int) resp);
-				}
+	hannodeaddr = curnode->addr;
+	if(flags.verbose)
+		printf("\n%u rows broadcast\n", base);
+	return res;
+}
 
-				if((cmd == BC_CHECK_APP) && (resp == STX)){
-					debug(DEBUG_UNEXPECTED, "Check App Failed");
-					return FAIL;
-				}
+/*
+* Check the rows on each node after a broadcast, and rewrite the ones which did not make it. If rowcrc is set,
+* the row CRCs are read back, and the rows which differ are written. Otherwise, a node whose app does not check out
+* gets every row again.
+*/
 
-				if((resp != ack)){				
-					debug(DEBUG_ACTION, "Did not get ACK");
-					if(resp == nak){
-						debug(DEBUG_UNEXPECTED, "***Retrying packet***, try = %d", retries);
-						usleep(100000);
-						continue;
-					}
-				}
-				else
-					break; // Success
+static int repair_nodes(serioStuff *s, row_t *rows, u32 count, u8 rowcrc, u8 writecmd, u8 window, u8 rle, u8 pack)
+{
+	u32 i, nbad;
+	int j, res = PASS;
+	u16 *crcs;
+	row_t *bad;
+
+	if(!(crcs = malloc(count * sizeof(u16))) || !(bad = malloc(count * sizeof(row_t))))
+		fatal("No memory for row repair list");
+
+	for(j = 0; (res == PASS) && (j < nnodes); j++){
+		node_select(nodes + j);
+		if(rowcrc){
+			res = read_list_crcs(s, rows, count, crcs);
+			for(i = 0, nbad = 0; (res == PASS) && (i < count); i++){
+				if(crcs[i] != do_crc(0, rows[i].data, LOADER_PAYLOAD))
+					bad[nbad++] = rows[i];
 			}
-			debug(DEBUG_UNEXPECTED,"Received invalid or no response, try = %d", retries);
-			usleep(100000);
 		}
-		if(retries == PACKET_RETRIES){
-			debug(DEBUG_EXPECTED, "Too many packet retries!");
-			return FAIL;
+		else{
+			nbad = (send_command(s, BC_CHECK_APP, 0, NULL)) ? count : 0;
+			memcpy(bad, rows, nbad * sizeof(row_t));
 		}
+		if(res != PASS)
+			break;
+		if(flags.verbose)
+			printf("Node 0x%02X: %u of %u rows to rewrite\n", hannodeaddr, nbad, count);
+		if(nbad)
+			res = write_rows(s, writecmd, bad, nbad, window, rle, pack);
 	}
-
-	seqno++;
-	return PASS;
-}
-	
-/* Calculate and check the packet CRC */
-
-static int packet_check()
-{
-	u16	rcrc16, crc16 =  do_crc(0, (u8 *) packet.buffer, packet_size - sizeof(u16));
-
-	rcrc16 = (flags.hanmode) ? packet.han.crc16 : packet.pbl.crc16;
-
-	debug(DEBUG_ACTION, "Rx CRC: 0x%04X, Calc CRC 0x%04X", rcrc16, crc16);
-
-	if(crc16 == rcrc16)
-		return PASS;
-	else
-		return FAIL;
-		
+	node_select(nodes);
+	free(crcs);
+	free(bad);
+	return res;
 }
 
 static void show_help(void)
 {
 	printf("\n");
-	printf("--address, -a                          : Specify han node address\n");
+	printf("--address, -a addr[,addr...]           : Specify han node address, or several to program at once\n");
+	printf("--baud, -b rate                        : Switch to the fastest baud rate the boot loader offers, up to rate\n");
 	printf("--check_after_programming, -c          : Check CRC of app on target after programming\n");
 	printf("--debug, -d                            : Set debug level (0-5). Used to to find bugs\n");
+	printf("--differential, -D                     : Only send rows which differ from the rows on the target\n");
 	printf("--eeprom, -e                           : Write to eeprom instead of program memory\n");
 	printf("--file, -f path/to/file.hex            : Specify .hex or .bin file name\n");
 	printf("--help, -h                             : Prints this text\n");
 	printf("--interrogate-only, -i                 : Interrograte boot loader on target and exit\n");
+	printf("--journal, -j dir                      : Keep a journal of each node's progress in dir, and resume from it\n");
+	printf("--make-delta, -m path/to/base.hex      : Make a delta package from base.hex to the file given with -f, and exit\n");
+	printf("--no-copy, -C                          : Do not use row copies in a delta package made with -m\n");
+	printf("--output, -O path/to/file.dlt          : Specify delta package file name for -m\n");
 	printf("--product-id, -o                       : Specify 16 bit product ID in hexadecimal\n");
 	printf("--port, -p pathtoport                  : Specify path name to port node\n");
 	printf("--reset, -r                            : Reset target after programming\n");
+	printf("--sparse, -s                           : Erase the app area on the target, then only send rows which are not blank\n");
 	printf("--verbose, -v                          : Print out additional info during use\n");
 	printf("--version, -V                          : Print version and exit\n");
 	printf("--execute, -x			       : Check app for integrity then execute it\n");
@@ -610,10 +2335,29 @@ static void show_help(void)
 	printf("pcl -i -p /dev/ttyUSB1                 : Interrogate only\n");
 	printf("pcl -x -p /dev/ttyUSB1                 : Check app and start it\n");
 	printf("pcl -a 1 -x -z pclr.conf               : Program HAN node at address 1 using config file\n");
+	printf("pcl -a 1,2,3 -x -p /dev/ttyUSB1 -f app.hex : Program HAN nodes 1, 2 and 3 at once\n");
+	printf("pcl -m old.hex -f new.hex -O new.dlt   : Make a delta package\n");
+	printf("pcl -x -p /dev/ttyUSB1 -f new.dlt      : Apply a delta package and execute\n");
 	printf("\n");
 }
 
 
+/*
+* Return the config file key for a serial port setting. Settings in a section named after the port, [/dev/ttyUSB0] say,
+* override the ones in the general section.
+*/
+
+static char *port_key(dictionary *dict, char *port, char *name)
+{
+	static char key[MAX_PATH + 32];
+
+	snprintf(key, sizeof(key), "%s:%s", port, name);
+	if(!iniparser_getstring(dict, key, NULL))
+		snprintf(key, sizeof(key), "general:%s", name);
+	return key;
+}
+
+
 
 /*
 * Top level
@@ -622,27 +2366,44 @@ static void show_help(void)
 int main(int argc, char *argv[])
 {
 	char optchar;
-	int longindex, i,res, crcerr;
+	int longindex, i,res;
 	u8 writecmd;
-	u32 bufbytepos;
+	u8 window = 0;
+	unsigned baudrate = 0;
+	u8 rle = 0;
+	u8 pack = 0;
+	u8 compound = 0;
+	u8 final = 0;
+	u8 checkexec = 0;
+	u8 broadcast = 0;
+	u8 rowcrc = 0;
+	u8 entering = 0;
+	u16 eesize = 0;
+	u8 eebytes = 0;
+	u32 bufbytepos, nrows, acked, start = 0;
 	u8 *buffer,*lastrow;
-	u16 wordaddr;
-	u16 rowsexceptlast, toprow;
+	u32 rowsexceptlast, toprow;
 	u16 crc16;
-	u16 load_size, load_size_bytes, load_address;
-	u16 bootloader_size;
+	u32 load_size, load_size_bytes, load_address;
+	u32 bootloader_size;
 	u32 max_app_size;
-	u32 bytes_received, bytes_sent;
 	ihx_t *ihx;
+	row_t *rows;
+	u16 *target_crcs = NULL;
+	delta_t *delta = NULL;
 	response_t *r;
 	config_area_t *cf;
 	serioStuff *s;
+	serioConfig sc = {0, 1, 0, 1, 0, 0};
+	struct timespec entry;
 	dictionary *dict = NULL;
 	static char exten[20];
 	char *q;
 
 	/* Die if packet structures screwed up */
-	assert(sizeof(packet_t) == PACKET_SIZE);
+	assert(sizeof(packet_t_han) == PACKET_SIZE);
+	assert(cobs_check());
+	assert(frame_check());
 		
 	progname = argv[0];
 
@@ -696,7 +2457,15 @@ int main(int argc, char *argv[])
 				fatal("In pcl.conf, product ID needs to be a hexadecimal value");
 			productid = (u16) i;
 		}
-		iniparser_freedict(dict);
+		s = iniparser_getstring(dict, "general:baud", NULL);
+		if(s){
+			if(sscanf(s, "%u", &maxbaud) != 1)
+				fatal("In pcl.conf, baud needs to be a decimal value");
+		}
+		s = iniparser_getstring(dict, "general:journal", NULL);
+		if(s)
+			strncpy(journal_dir, s, MAX_PATH - 1);
+		// Port settings are read once the port is known
 	}
 	else if(flags.configfileoverride){
 		fatal("Cannot open config file: %s\n", config_file);
@@ -721,13 +2490,31 @@ int main(int argc, char *argv[])
 
 			/* Was it han node address request? */
 			case 'a':
-				if(sscanf(optarg, "%hx", &hannodeaddr) != 1)
+				for(nnodes = 0, q = strtok(optarg, ","); q; q = strtok(NULL, ",")){
+					if(nnodes == MAX_NODES)
+						fatal("Too many node addresses");
+					if(sscanf(q, "%hx", &nodes[nnodes].addr) != 1)
+						fatal("Invalid node address");
+					if(nodes[nnodes].addr > 32)
+						fatal("Node address out of range");
+					for(i = 0; i < nnodes; i++){
+						if(nodes[i].addr == nodes[nnodes].addr)
+							fatal("Node address 0x%02X given twice", nodes[i].addr);
+					}
+					nnodes++;
+				}
+				if(!nnodes)
 					fatal("Invalid node address");
-				if(hannodeaddr > 32)
-					fatal("Node address out of range");
+				hannodeaddr = nodes[0].addr;
 				flags.hanmode = 1;
 				break;	
 
+			/* Was it a baud rate request? */
+			case 'b':
+				if(sscanf(optarg, "%u", &maxbaud) != 1)
+					fatal("Invalid baud rate");
+				break;
+
 
 			/* Was it a check app request? */
 			case 'c':
@@ -744,6 +2531,16 @@ int main(int argc, char *argv[])
 				}
 				break;
 
+			/* Don't plan row copies in delta packages? */
+			case 'C':
+				flags.nocopy = 1;
+				break;
+
+			/* Was it a differential write request? */
+			case 'D':
+				flags.differential = 1;
+				break;
+
 			case 'e':
 				flags.eeprom = 1;
 				break;
@@ -764,6 +2561,24 @@ int main(int argc, char *argv[])
 				flags.interrogateonly = 1;
 				break;
 
+			/* Was it a journal directory? */
+			case 'j':
+				memset(journal_dir, 0, MAX_PATH);
+				strncpy(journal_dir, optarg, MAX_PATH - 1);
+				break;
+
+			/* Was it a make delta request? */
+			case 'm':
+				memset(basefile, 0, MAX_PATH);
+				strncpy(basefile, optarg, MAX_PATH - 1);
+				flags.makedelta = 1;
+				break;
+
+			case 'O':
+				memset(outfile, 0, MAX_PATH);
+				strncpy(outfile, optarg, MAX_PATH - 1);
+				break;
+
 			case 'o':
 				if(sscanf(optarg, "%X", &i) != 1)
 					fatal("Product ID needs hexadecimal value");
@@ -781,6 +2596,11 @@ int main(int argc, char *argv[])
 				flags.reset = 1;
 				break;	
 
+			/* Was it a sparse write request? */
+			case 's':
+				flags.sparse = 1;
+				break;
+
 			/* Was it a verbose request? */
 			case 'v':
 				flags.verbose = 1;
@@ -810,12 +2630,25 @@ int main(int argc, char *argv[])
 		fatal("Extra argument on commandline, '%s'", argv[optind]);
 	}
 
+	if(flags.makedelta){ /* Offline, no target needed */
+		if(!file[0] || !outfile[0])
+			fatal("-m needs a new hex file (-f) and an output file (-O)");
+		make_delta(basefile, file, outfile);
+		exit(0);
+	}
+
 	if(flags.eeprom && (flags.execute | flags.checkapp))
 		fatal("-e is not valid with -x or -c");
 
+	if(flags.differential && (flags.eeprom | flags.sparse))
+		fatal("-D is not valid with -e or -s");
+
 	if(!(flags.interrogateonly | flags.execute | flags.checkapp | flags.eeprom))
 		fatal("What do you want me to do, anyhow? Must specify -e, -c, -i, or -x");
 
+	if((nnodes > 1) && (!file[0] || flags.interrogateonly || flags.eeprom || flags.sparse || flags.differential))
+		fatal("Several nodes can only be sent a program memory image (-f), not with -i, -e, -s or -D");
+
 	r = (response_t *) ((flags.hanmode) ? packet.han.payload : packet.pbl.payload);
 	cf = (config_area_t *) r->config;
 
@@ -844,6 +2677,8 @@ int main(int argc, char *argv[])
                 		}
 
 				flags.handisrunning = 1; // Set flag indicating comm is going to go through hand
+				if(nnodes > 1)
+					fatal("Several nodes can only be programmed over a serial port, stop hand first");
 				memset(&client_command,0,sizeof(Client_Command)); // Send boot loader entry command
 				client_command.request = HAN_CCMD_SENDPKT;
 				client_command.cmd.pkt.nodecommand = HAN_CMD_GEBL; 
@@ -858,83 +2693,89 @@ int main(int argc, char *argv[])
 				if(!res){
 					printf("Waiting for boot loader to initialize...");
 					fflush(stdout);
-					usleep(3000000); // Wait for boot loader to activate 
-					printf("OK\n");
+					deadline_set(&entry, ENTRY_TIMEOUT); // Probed with queries below until it answers
+					entering = 1;
 				}
 			}
 		}
 		// Set up packet parameters for addressable mode
-		packet.han.param = 0x55AA; // Not required by protocol
+		queryparam = QUERY_OPTS;
+		if(!flags.handisrunning)
+			queryparam |= QO_NAK_REASON; // Hand only passes single byte NAKs
+		if(file[0] && !flags.interrogateonly)
+			queryparam |= QO_WRITE_EN; // Loaders with CAP_COMPOUND enable writes on the query
+		packet.han.param = queryparam;
 		packet.han.pkttype = HDC;
 		packet.han.addr = (u8) hannodeaddr;
-		packet_size = sizeof(packet_t);
+		packet_size = sizeof(packet_t_han);
 	}
 	else{ // Non-addressable operating mode
-		packet.pbl.param = 0x55AA; // Not required by protocol
+		packet.pbl.param = queryparam; // Not required by protocol
 		packet_size = sizeof(packet_t_pbl);
 	}
+	packet_txsize = packet_size;
 
 
 	if(!flags.handisrunning){ // If not going through hand
 		if(!port[0])
 			fatal("Missing port (-p) option on command line or config file");
 
-		if(!(s = serio_open(port, (flags.hanmode) ? 9600 : 57600)))
-			fatal("Can't open serial port %s\n", port);
-
-		serio_flush_input(s);
-		packet_finalize();
-		debug(DEBUG_ACTION, "Transmit Packet CRC: 0x%04X", (flags.hanmode) ? packet.han.crc16 : packet.pbl.crc16);
-		if((bytes_sent = packet_tx(s, packet.buffer, packet_size, 5000000)) < 0)
-			fatal("Packet write error");
-		debug(DEBUG_ACTION, "Bytes Sent: %d", bytes_sent);
-
-		if(bytes_sent != packet_size)
-			fatal("Packet write incomplete");
-
-
-		packet_init(); // Just to be sure we get something
-
+		if(dict){
+			sc.low_latency = iniparser_getboolean(dict, port_key(dict, port, "low-latency"), 0);
+			sc.latency_timer = iniparser_getint(dict, port_key(dict, port, "latency-timer"), 1);
+			if((sc.latency_timer < 1) || (sc.latency_timer > 255))
+				fatal("In pcl.conf, latency-timer needs to be between 1 and 255 ms");
+			sc.rs485 = iniparser_getboolean(dict, port_key(dict, port, "rs485"), 0);
+			sc.rs485_rts_on_send = iniparser_getboolean(dict, port_key(dict, port, "rs485-rts-on-send"), 1);
+			sc.rs485_delay_before = iniparser_getint(dict, port_key(dict, port, "rs485-delay-before"), 0);
+			sc.rs485_delay_after = iniparser_getint(dict, port_key(dict, port, "rs485-delay-after"), 0);
+			if((sc.rs485_delay_before < 0) || (sc.rs485_delay_after < 0))
+				fatal("In pcl.conf, RS-485 delays can't be negative");
+			flags.rs485 = sc.rs485;
+		}
+		debug(DEBUG_ACTION, "Low latency mode: %s", (sc.low_latency) ? "on" : "off");
+		if(sc.rs485)
+			debug(DEBUG_ACTION, "RS-485 mode, RTS %s on send, delays %d ms before and %d ms after",
+			(sc.rs485_rts_on_send) ? "high" : "low", sc.rs485_delay_before, sc.rs485_delay_after);
+
+		baudrate = (flags.hanmode) ? HAN_BAUD : 57600;
+		if(!(s = serio_open(port, baudrate, &sc)))
+			fatal("Can't open serial port %s: %s\n", port, strerror(errno));
+	}
+	else
+		debug(DEBUG_ACTION,"Sending packets through hand");
+	if(dict){
+		// Noisy bus, add FEC check bytes if the loader can use them. Hand owns the port, so only [general] applies.
+		flags.fec = iniparser_getboolean(dict, (flags.handisrunning) ? "general:fec" : port_key(dict, port, "fec"), 0);
+		iniparser_freedict(dict);
+	}
 
-		// Wait for response
-		bytes_received = packet_rx(s, packet.buffer, packet_size, 5000000);
-		debug(DEBUG_ACTION, "Bytes Received: %d", bytes_received);
-		if(bytes_received < 0)
-			fatal("Packet read error");
-		if((bytes_received != packet_size)) // Must see a packet, not just an ACK
-			fatal("Packet read incomplete, received %d bytes", bytes_received);
-		if(packet_check())
-			fatal("Packet CRC error");
+	packet_finalize();
+	debug(DEBUG_ACTION, "Transmit Packet CRC: 0x%04X", (flags.hanmode) ? packet.han.crc16 : packet.pbl.crc16);
+	if(entering){
+		if(wait_for_loader(s, &entry, HAN_BAUD))
+			fatal("Boot loader did not answer within %d ms of the entry command", ENTRY_TIMEOUT / 1000);
+	}
+	else if(packet_request(s, PACKET_RETRIES, 5000000))
+		fatal("No valid response to query packet");
 
+	/* NAKs carry a reason if the loader supports them, and the query asked for them */
+	if((r->proto >= PROTO_NAKR) && query_opt(QO_NAK_REASON))
+		flags.nakreason = 1;
 
+	/* Forward error correction if pcl.conf asks for it, and the loader supports it */
+	if(flags.fec && (!flags.hanmode || !(r->caps2 & CAP2_FEC))){
+		warn("Boot loader does not support FEC, sending packets without it");
+		flags.fec = 0;
 	}
-	else{ // Send packets through hand */
 
-		debug(DEBUG_ACTION,"Sending packets through hand");
-		packet_finalize();
-		debug(DEBUG_ACTION, "Transmit Packet CRC: 0x%04X", (flags.hanmode) ? packet.han.crc16 : packet.pbl.crc16);
-		for(i = 0; i < PACKET_RETRIES; i++){
-			client_command.cmd.raw.txlen = packet_format(client_command.cmd.raw.txbuffer, &packet.han, packet_size);
-			client_command.cmd.raw.rxexpectlen = 255;
-			client_command.cmd.raw.txtimeout = 100000;
-			client_command.cmd.raw.rxtimeout = 500000;
-			client_command.request = HAN_CCMD_RAW_PACKET;
-			res = hanclient_send_command_return_res(&client_command);
-			if((!res) && (client_command.cmd.raw.rxexpectlen))
-				bytes_received = packet_unformat(packet.buffer, client_command.cmd.raw.rxbuffer, 255);
-			else
-				bytes_received = 0;
-			if(bytes_received)
-				crcerr = packet_check();
-			else
-				crcerr = 0;
-			if((bytes_received == packet_size) && (!crcerr)) // Must see a packet with a good CRC, not just an ACK
-				break;
-			debug(DEBUG_UNEXPECTED,"Query packet receive error, try = %d", i);
-			debug(DEBUG_UNEXPECTED,"bytes_received = %d crcerr = %d", bytes_received, crcerr);
-		}
-		if(i == PACKET_RETRIES)
-			fatal("Too many packet retries!");
+	/* Switch to a faster baud rate if asked to */
+
+	if(maxbaud && !flags.handisrunning){
+		if(nnodes > 1)
+			warn("Staying at %u baud with several nodes", baudrate);
+		else
+			change_baud(s, r, maxbaud, baudrate);
 	}
 
 	if(flags.verbose || flags.interrogateonly){
@@ -943,6 +2784,15 @@ int main(int argc, char *argv[])
 		printf("Product ID          : 0x%04X\n", r->prodid); 
 		printf("Boot Program Version: 0x%02X\n", r->bootvers);
 		printf("Protocol Number     : 0x%02X\n", r->proto);
+		if(r->proto >= PROTO_WINDOW)
+			printf("Write Window        : %u rows\n", r->window);
+		printf("Capabilities        : 0x%02X\n", r->caps);
+		if(r->rowwords){
+			printf("Row Size in Words   : %u\n", r->rowwords);
+			printf("Rows per Packet     : %u\n", r->maxrows);
+			printf("EEPROM Size in Bytes: %u\n", r->eesize);
+			printf("More Capabilities   : 0x%02X\n", r->caps2);
+		}
 		printf("Device User 1       : 0x%04X\n", cf->user1);
 		printf("Device User 2       : 0x%04X\n", cf->user2);
 		printf("Device User 3       : 0x%04X\n", cf->user3);
@@ -952,6 +2802,16 @@ int main(int argc, char *argv[])
 		printf("Device Config 2     : 0x%04X\n", cf->config2);
 	}
 
+	if((flags.execute) && (!file[0]) && (r->caps & CAP_COMPOUND)){ /* Check and execute in one round trip */
+		printf("Check App and Execute: ");
+		if(send_command(s, BC_CHECK_EXEC, 0, NULL)){
+			printf("FAILED\n");
+			exit(1);
+		}
+		printf("PASSED\n");
+		exit(0);
+	}
+
 	if((flags.execute) && (!file[0])){ /* Special case for execute without load */
 		printf("Check App: ");	
 		if(send_command(s, BC_CHECK_APP, 0, NULL)){
@@ -979,10 +2839,71 @@ int main(int argc, char *argv[])
 	if(r->bootvers > BOOT_VERSION_SUPPORTED)
 		fatal("Do not know how to deal with bootversion %d\n", r->bootvers);
 
-	if(r->proto)
+	if(r->proto > PROTOCOL)
 		fatal("Does not support protocol version %d\n", r->proto);
 
+	/* Use windowed writes if the loader can buffer more than one row */
+	if(r->proto >= PROTO_WINDOW)
+		window = (r->window > MAX_WINDOW) ? MAX_WINDOW : r->window;
+	debug(DEBUG_ACTION, "Write window: %u rows", window);
+
+	/* Check the row size, and send more than one row per packet if the loader can take them */
+	if(r->rowwords && (r->rowwords != (LOADER_PAYLOAD >> 1)))
+		fatal("Boot loader row size of %u words is not supported", r->rowwords);
+	if((r->proto >= PROTO_ROWS) && r->maxrows && !flags.handisrunning) // Hand can only pass single row packets
+		packet_rows = (r->maxrows > MAX_PACKET_ROWS) ? MAX_PACKET_ROWS : r->maxrows;
+	debug(DEBUG_ACTION, "Rows per packet: %u", packet_rows);
+
+	/* Switch to COBS framing if the loader supports it. Hand only passes byte stuffed packets. */
+	if((r->proto >= PROTO_COBS) && !flags.handisrunning)
+		flags.cobs = 1;
+	debug(DEBUG_ACTION, "Framing: %s", (flags.cobs) ? "COBS" : "byte stuffing");
+
+	/* Leave out the unused payload and the pad if the loader supports short packets */
+	if(flags.hanmode && (r->proto >= PROTO_SHORT) && !flags.handisrunning)
+		flags.shortpkt = 1;
+
+	/* Loaders which do not report the EEPROM size are on 16F193X parts */
+	eesize = (r->eesize) ? r->eesize : 256;
+	eebytes = (r->proto >= PROTO_ROWS); // The response is overwritten by the next packet
+
+	/* Use run length coded writes if the loader supports them */
+	if((!flags.eeprom) && (r->caps & CAP_RLE))
+		rle = 1;
+
+	/* Pack program words into 14 bits if the loader can unpack them */
+	if((!flags.eeprom) && (r->caps & CAP_PACK))
+		pack = 1;
+
+	/* Fold command pairs into one round trip if the loader supports it */
+	if(r->caps & CAP_COMPOUND)
+		compound = 1;
+
+	/* Program several nodes at once, by broadcasting the rows to all of them, or with windows they commit without a response */
+	if(nnodes > 1){
+		if(r->caps2 & CAP2_BROADCAST)
+			broadcast = 1;
+		else if((window < 2) || !(r->caps2 & CAP2_INTERLEAVE))
+			fatal("Boot loader cannot program several nodes at once");
+		query_nodes(s, r);
+	}
+
+	rowcrc = (r->caps & CAP_ROW_CRC) ? 1 : 0;
+
+	if(flags.sparse && (flags.eeprom || !(r->caps & CAP_ERASE))){
+		if(!flags.eeprom)
+			warn("Boot loader does not support range erase, sending all rows");
+		flags.sparse = 0;
+	}
+
+	if(flags.differential && !(r->caps & CAP_ROW_CRC)){
+		warn("Boot loader does not support row CRCs, sending all rows");
+		flags.differential = 0;
+	}
+
 	max_app_size = r->appsize;
+	if(r->caps2 & CAP2_ADDRU)
+		max_app_size |= ((u32) r->appsizeu) << 16;
 	bootloader_size = r->lsize;
 
 	if(!file[0])
@@ -994,8 +2915,7 @@ int main(int argc, char *argv[])
 
 	if(!flags.eeprom){
 		/* Fill buffer with erase pattern */	
-		for(i = 0 ; i < max_app_size << 1; i++)
-			buffer[i] = (i & 1) ? 0x3F : 0xFF;
+		fill_erase_pattern(buffer, max_app_size << 1);
 	}
 
 	/* Locate the extension if it exists */
@@ -1014,7 +2934,7 @@ int main(int argc, char *argv[])
 
 	if(!strcmp(exten, "hex")){
 		/* Hex files */
-		if(!(ihx = ihx_read( file, buffer, max_app_size << 1)))
+		if(!(ihx = ihx_read( file, buffer, max_app_size << 1, (flags.eeprom) ? ~0U : (bootloader_size + max_app_size) << 1)))
 			fatal("Could not open and/or read hex file");
 
 		load_address = ihx->load_address >> 1;
@@ -1038,6 +2958,23 @@ int main(int argc, char *argv[])
 		load_size_bytes = br;
 		load_address = bootloader_size;
 	}
+	else if(!strcmp(exten, "dlt")){
+		/* Delta packages */
+		if(flags.eeprom || flags.sparse || flags.differential || (nnodes > 1))
+			fatal("-e, -s, -D and several nodes are not valid with a delta package");
+
+		if(!(delta = delta_read(file)))
+			fatal("Could not open and/or read delta package");
+
+		if(delta->row_bytes != LOADER_PAYLOAD)
+			fatal("Delta package row size %u does not match %u", delta->row_bytes, LOADER_PAYLOAD);
+
+		load_address = delta->load_address;
+		load_size_bytes = delta->rowsused * LOADER_PAYLOAD;
+		load_size = load_size_bytes >> 1;
+		if(flags.verbose)
+			printf("Delta: %u changed rows, base CRC 0x%04X, new CRC 0x%04X\n", delta->count, delta->base_crc, delta->new_crc);
+	}
 	else{
 		if(strlen(exten))
 			fatal("Unrecognizable file format %s", exten);
@@ -1048,9 +2985,9 @@ int main(int argc, char *argv[])
 	if(flags.eeprom){
 		writecmd = BC_WRITE_EEPROM;
 		load_address = 0;
-		rowsexceptlast = 4; // For pic 16F193X
-		if(load_size_bytes != 256)
-			fatal("EEPROM hex file must contain exactly 256 bytes");
+		rowsexceptlast = eesize / LOADER_PAYLOAD;
+		if(load_size_bytes != eesize)
+			fatal("EEPROM hex file must contain exactly %u bytes", eesize);
 	}
 	else{
 		writecmd = BC_WRITE_PM;
@@ -1060,109 +2997,251 @@ int main(int argc, char *argv[])
 		toprow = ((max_app_size << 1) - LOADER_PAYLOAD) / LOADER_PAYLOAD;
 
 		debug(DEBUG_ACTION,"Actual App Size in Words: %u", load_size);
-		debug(DEBUG_ACTION,"App Load Word Address: 0x%04X", load_address);
+		debug(DEBUG_ACTION,"App Load Word Address: 0x%06X", load_address);
 		debug(DEBUG_ACTION, "rowsexceptlast = %u", rowsexceptlast);
 		debug(DEBUG_ACTION, "toprow = %u\n", toprow);
 	}
 	
 
 	if(!flags.eeprom){
-		// Calculate CRC on all rows in buffer except the last one
-		crc16 = do_crc(0, buffer, rowsexceptlast * LOADER_PAYLOAD);
-
-		debug(DEBUG_ACTION,"App CRC: 0x%04X", crc16);
-
 		if(load_address != bootloader_size)
 			fatal("Wrong App Load Address");
+		if((nnodes > 1) && ((load_address + ((toprow + 1) * (LOADER_PAYLOAD >> 1)) - 1) >> 16))
+			fatal("Several nodes can only be programmed on parts with up to 64K words of program memory");
 
-
-		// Write the info bytes into the last 16 bits of the top row.
 		lastrow = buffer + ((max_app_size << 1) - LOADER_PAYLOAD);
-		lastrow[SIGLO] = 0xAA;
-		lastrow[SIGLO + 1] = 0; // 6 bit locations are useless, zero them out for readability.
-		lastrow[SIGHI] = 0x55;
-		lastrow[SIGHI + 1] = 0;
-		lastrow[RULO] = (u8) rowsexceptlast;
-		lastrow[RULO + 1] = 0;
-		lastrow[RUHI] = (u8) (rowsexceptlast >> 8);
-		lastrow[RUHI + 1] = 0;
-		lastrow[RFULO] = 0;
-		lastrow[RFULO + 1] = 0;
-		lastrow[RFUHI] = 0;
-		lastrow[RFUHI + 1] = 0;
-		lastrow[CRCLO] = (u8) crc16;
-		lastrow[CRCLO + 1] = 0;
-		lastrow[CRCHI] = (u8) (crc16 >> 8);
-		lastrow[CRCHI + 1] = 0;
+		if(delta){
+			// The delta package carries the new top row
+			memcpy(lastrow, delta->toprow, LOADER_PAYLOAD);
+		}
+		else{
+			// Calculate CRC on all rows in buffer except the last one
+			crc16 = do_crc(0, buffer, rowsexceptlast * LOADER_PAYLOAD);
+
+			debug(DEBUG_ACTION,"App CRC: 0x%04X", crc16);
+
+			// Write the info bytes into the last 16 bits of the top row.
+			info_row_fill(lastrow, rowsexceptlast, crc16);
+		}
 	}
 
-	debug(DEBUG_ACTION, "Sending Write Enable Command");
+	/* A delta package can only be applied to the image it was made from */
 
+	if(delta){
+		if(!(r->caps & CAP_CHECK_CRC))
+			fatal("Boot loader cannot check the base image of a delta package");
+		if(delta->ncopies && !(r->caps & CAP_COPY))
+			fatal("Boot loader cannot copy rows, make the delta package with -C");
+		for(i = 0; i < delta->count; i++){
+			if((delta->wordaddr[i] < load_address) || (delta->wordaddr[i] >= load_address + toprow * (LOADER_PAYLOAD >> 1)))
+				fatal("Delta package row address 0x%04X is outside of the app area", delta->wordaddr[i]);
+		}
+		for(i = 0; i < delta->ncopies; i++){
+			if((delta->copydst[i] < load_address) || (delta->copydst[i] >= load_address + toprow * (LOADER_PAYLOAD >> 1)) ||
+			(delta->copysrc[i] < load_address) || (delta->copysrc[i] > load_address + (toprow - 1) * (LOADER_PAYLOAD >> 1)))
+				fatal("Delta package row copy 0x%04X to 0x%04X is outside of the app area", delta->copysrc[i], delta->copydst[i]);
+		}
+		printf("Check Base Image: ");
+		if(send_command(s, BC_CHECK_CRC, delta->base_crc, NULL)){
+			printf("FAILED\n");
+			fatal("Target is not running the base image of this delta package (app CRC 0x%04X)", delta->base_crc);
+		}
+		printf("PASSED\n");
+	}
 
-	if(send_command(s, BC_WRITE_EN, 0, NULL))
-		fatal("Write Enable Command Failed");
+	for(i = 0; i < nnodes; i++){
+		node_select(nodes + i);
+		if(compound && query_opt(QO_WRITE_EN))
+			debug(DEBUG_ACTION, "Writes enabled by the query");
+		else{
+			debug(DEBUG_ACTION, "Sending Write Enable Command");
+			if(send_command(s, BC_WRITE_EN, 0, NULL))
+				fatal("Write Enable Command Failed");
+		}
+	}
+	node_select(nodes);
 
 
 	if(debuglvl > DEBUG_ACTION)
 		hex_dump(buffer, load_size_bytes, 1);
 
+	/* In differential mode, get the CRC of each app row and the top row on the target. Rows which match are left out of the row list */
 
-	/* Write program memory or eeprom */
+	if(flags.differential){
+		if(!(target_crcs = malloc((rowsexceptlast + 1) * sizeof(u16))))
+			fatal("No memory for row CRC table");
+		if(read_row_crcs(s, load_address, rowsexceptlast, target_crcs) ||
+		read_row_crcs(s, load_address + toprow * (LOADER_PAYLOAD >> 1), 1, target_crcs + rowsexceptlast))
+			fatal("Could not read row CRCs from target");
+	}
 
-	for(i = 0 ; i < rowsexceptlast; i++){
-		bufbytepos = i * LOADER_PAYLOAD;
-		wordaddr = (bufbytepos >> 1) + load_address;
-		debug(DEBUG_ACTION, "wordaddr: 0x%04X, bufbytepos: 0x%04X", wordaddr, bufbytepos);
-		if(send_command(s, writecmd, wordaddr, buffer + bufbytepos))
-			fatal("\nWrite Program Memory Failed");
-		if(debuglvl == DEBUG_UNEXPECTED){
-			printf(".");
-			if((i & 63) == 63)
-				printf("\n");
-			fflush(stdout);
-		}
+	/* In sparse mode, erase the rows covered by the app CRC. Blank rows are then left out of the row list */
+
+	if(flags.sparse){
+		debug(DEBUG_ACTION, "Erasing %u rows", rowsexceptlast);
+		if(erase_rows(s, load_address, rowsexceptlast))
+			fatal("Erase Program Memory Failed");
+	}
 
+	/* Carry out the row copies in a delta package first, while the base image is still intact */
 
+	if(delta && delta->ncopies){
+		debug(DEBUG_ACTION, "Copying %u rows", delta->ncopies);
+		if(copy_rows(s, delta->copydst, delta->copysrc, delta->ncopies))
+			fatal("Copy Program Memory Failed");
 	}
-	if(debuglvl == DEBUG_UNEXPECTED)
-		printf("\n");
 
-	/* Write the top row if not eeprom and the top row stands alone from the app */
+
+	/* Build the list of rows to write */
+
+	if(!(rows = malloc((rowsexceptlast + ((delta) ? delta->count : 0) + 1) * sizeof(row_t))))
+		fatal("No memory for row list");
+
+	for(i = 0, nrows = 0 ; delta && (i < delta->count); i++){
+		rows[nrows].wordaddr = delta->wordaddr[i];
+		rows[nrows++].data = delta->rows + (i * LOADER_PAYLOAD);
+	}
+
+	for(i = 0; (!delta) && (i < rowsexceptlast); i++){
+		bufbytepos = i * LOADER_PAYLOAD;
+		if(flags.sparse && row_is_blank(buffer + bufbytepos))
+			continue;
+		if(flags.differential && (target_crcs[i] == do_crc(0, buffer + bufbytepos, LOADER_PAYLOAD)))
+			continue;
+		// EEPROM rows are addressed in bytes from protocol 2, in words before
+		if(flags.eeprom)
+			rows[nrows].wordaddr = (eebytes) ? bufbytepos : (bufbytepos >> 1);
+		else
+			rows[nrows].wordaddr = (bufbytepos >> 1) + load_address;
+		rows[nrows++].data = buffer + bufbytepos;
+	}
+	if(flags.sparse && flags.verbose)
+		printf("Skipping %u blank rows out of %u\n", rowsexceptlast - nrows, rowsexceptlast);
+	if(flags.differential && flags.verbose)
+		printf("%u of %u rows differ from the target\n", nrows, rowsexceptlast);
+
+	/* Write the top row last if not eeprom and the top row stands alone from the app */
 	if((!flags.eeprom) && (rowsexceptlast < toprow)){
-		debug(DEBUG_ACTION, "Gap between app. end and top row, writing top row ");
 		bufbytepos = toprow * LOADER_PAYLOAD;
-		wordaddr = (bufbytepos >> 1) + load_address;
-		debug(DEBUG_ACTION, "wordaddr: 0x%04X, bufbytepos: 0x%04X", wordaddr, bufbytepos);
-		if(send_command(s, BC_WRITE_PM, wordaddr, buffer + bufbytepos))
-			fatal("Write Program Memory Failed");
+		if(flags.differential && (target_crcs[rowsexceptlast] == do_crc(0, buffer + bufbytepos, LOADER_PAYLOAD))){
+			debug(DEBUG_ACTION, "Top row matches the target, not writing top row");
+		}
+		else{
+			debug(DEBUG_ACTION, "Gap between app. end and top row, writing top row ");
+			rows[nrows].wordaddr = (bufbytepos >> 1) + load_address;
+			rows[nrows++].data = buffer + bufbytepos;
+		}
 	}
 
-	if((flags.checkapp)||(flags.execute)){
-		printf("Check App: ");	
-		if(send_command(s, BC_CHECK_APP, 0, NULL)){
-			printf("FAILED\n");
-			exit(1);
+	/*
+	* Journal the writes, and resume an interrupted session from the first row the target does not have. The top row
+	* is last in the list, so it is still written last. Erasing or copying rows first would undo the rows already written,
+	* so sparse mode and delta packages are not journalled.
+	*/
+
+	if(journal_dir[0] && (!flags.eeprom) && (!flags.sparse) && (!delta) && (nnodes == 1) && nrows){
+		if(flags.handisrunning)
+			snprintf(journal.path, sizeof(journal.path), "%s/pcl-%02X.jnl", journal_dir, hannodeaddr);
+		else{
+			// Nodes on different ports can have the same address, so the port goes in the name too
+			q = strrchr(port, '/');
+			snprintf(journal.path, sizeof(journal.path), "%s/pcl-%s-%02X.jnl", journal_dir, (q) ? q + 1 : port, hannodeaddr);
 		}
-		else
-			printf("PASSED\n");
-	}
-	if(flags.execute){
-		printf("Executing App... ");
-		if(send_command(s, BC_EXEC_APP, 0, NULL)){
-			printf("FAILED\n");
-			exit(1);
+		journal.imagecrc = image_crc(rows, nrows);
+		journal.nrows = nrows;
+		if((acked = journal_read())){
+			if(!rowcrc)
+				warn("Boot loader does not support row CRCs, cannot resume");
+			else{
+				if(!(target_crcs = realloc(target_crcs, acked * sizeof(u16))))
+					fatal("No memory for row CRC table");
+				if(read_list_crcs(s, rows, acked, target_crcs))
+					fatal("Could not read row CRCs from target");
+				for(start = 0; (start < acked) && (target_crcs[start] == do_crc(0, rows[start].data, LOADER_PAYLOAD)); start++);
+				printf("Resuming at row %u of %u\n", start, nrows);
+			}
 		}
+		journal.start = journal.acked = start;
+	}
+
+	/* Write program memory or eeprom. If the app is to be checked, the last row is held back and written with BC_WRITE_PMC. */
+
+	if(compound && (nnodes == 1) && (!flags.eeprom) && (flags.checkapp || flags.execute) && nrows)
+		final = 1;
+	else if(compound && flags.execute)
+		checkexec = 1;
+
+	if(broadcast){
+		if(write_broadcast(s, rows, nrows, pack) || repair_nodes(s, rows, nrows, rowcrc, writecmd, window, rle, pack))
+			fatal("\nWrite Program Memory Failed");
+	}
+	else if(nnodes > 1){
+		if(write_interleaved(s, rows, nrows, window, pack))
+			fatal("\nWrite Program Memory Failed");
+	}
+	else if(write_rows(s, writecmd, rows + start, nrows - final - start, (flags.eeprom) ? 0 : window, rle, pack))
+		fatal("\nWrite Program Memory Failed");
+	journal_remove();
+
+	if(flags.cobs && flags.verbose && stuffed_bytes)
+		printf("\nCOBS framing: %u bytes sent, %u escape bytes saved (%u%%)\n", cobs_bytes,
+		stuffed_bytes - cobs_bytes, ((stuffed_bytes - cobs_bytes) * 100) / stuffed_bytes);
+
+	if(debuglvl == DEBUG_UNEXPECTED)
 		printf("\n");
-	}		
-	else if(flags.reset){
-		printf("Resetting MPU... ");
-		if(send_command(s, BC_RESET, 0, NULL)){
-			printf("FAILED\n");
-			exit(1);
+
+	for(i = 0; i < nnodes; i++){
+		node_select(nodes + i);
+		if(nnodes > 1)
+			printf("Node 0x%02X: ", hannodeaddr);
+		if(final){
+			debug(DEBUG_ACTION, "wordaddr: 0x%04X, writing last row and checking app", rows[nrows - 1].wordaddr);
+			printf("Check App: ");	
+			if(send_command(s, BC_WRITE_PMC, rows[nrows - 1].wordaddr, rows[nrows - 1].data)){
+				printf("FAILED\n");
+				exit(1);
+			}
+			else
+				printf("PASSED\n");
 		}
-		printf("\n");
-	}		
+		else if(checkexec){
+			printf("Check App and Execute: ");
+			if(send_command(s, BC_CHECK_EXEC, 0, NULL)){
+				printf("FAILED\n");
+				exit(1);
+			}
+			printf("PASSED\n");
+		}
+		else if((flags.checkapp)||(flags.execute)){
+			printf("Check App: ");	
+			if(send_command(s, BC_CHECK_APP, 0, NULL)){
+				printf("FAILED\n");
+				exit(1);
+			}
+			else
+				printf("PASSED\n");
+		}
+		if(flags.execute && !checkexec){
+			printf("Executing App... ");
+			if(send_command(s, BC_EXEC_APP, 0, NULL)){
+				printf("FAILED\n");
+				exit(1);
+			}
+			printf("\n");
+		}		
+		else if(flags.reset){
+			printf("Resetting MPU... ");
+			if(send_command(s, BC_RESET, 0, NULL)){
+				printf("FAILED\n");
+				exit(1);
+			}
+			printf("\n");
+		}		
+	}
 	printf("DONE\n");
+	delta_free(delta);
+	free(target_crcs);
+	free(rows);
 	free(buffer);		
 	exit(0);
 }
@@ -40,8 +40,115 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 #include "serio.h"
 
+#if defined(__linux__) && defined(TCGETS2)
+/*
+ * Arbitrary baud rates are set with the Linux termios2 ioctls. The kernel's struct termios2 can't be
+ * included along with glibc's termios.h, so it is declared here.
+ */
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+#define SERIO_TERMIOS2
+#endif
+
+/* Standard baud rates */
+
+static const struct {
+	unsigned baudrate;
+	speed_t brc;
+} baudrates[] = {
+	{9600, B9600},
+	{19200, B19200},
+	{38400, B38400},
+	{57600, B57600},
+	{115200, B115200},
+	{230400, B230400},
+#ifdef B460800
+	{460800, B460800},
+#endif
+#ifdef B500000
+	{500000, B500000},
+#endif
+#ifdef B921600
+	{921600, B921600},
+#endif
+#ifdef B1000000
+	{1000000, B1000000},
+#endif
+	{0, B0}
+};
+
+/*
+ * Ask the driver, and the latency timer of a USB adapter where sysfs has one, to pass
+ * received bytes on right away. Neither is fatal, not every driver has them.
+ */
+
+static void serio_low_latency(serioStuff *serio, char *tty_name, int latency_timer) {
+#if defined(__linux__) && defined(TIOCSSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct serial;
+	char path[PATH_MAX];
+	char attr[PATH_MAX + 64];
+	char *name;
+	FILE *f;
+	
+	if(ioctl(serio->fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(serio->fd, TIOCSSERIAL, &serial);
+	}
+	
+	/* Follow links such as /dev/serial/by-id, sysfs knows the port by its tty name. */
+	if(!realpath(tty_name, path)) {
+		return;
+	}
+	name = strrchr(path, '/') + 1;
+	snprintf(attr, sizeof(attr), "/sys/class/tty/%s/device/latency_timer", name);
+	if((f = fopen(attr, "w"))) {
+		fprintf(f, "%d\n", latency_timer);
+		fclose(f);
+	}
+#endif
+}
+
+/*
+ * Hand the transmit enable of an RS-485 transceiver on RTS to the kernel, which turns
+ * the bus round itself, with the configured delays.
+ */
+
+static int serio_rs485(serioStuff *serio, serioConfig *config) {
+#if defined(__linux__) && defined(TIOCSRS485)
+	struct serial_rs485 rs485;
+	
+	memset(&rs485, 0, sizeof(rs485));
+	rs485.flags = SER_RS485_ENABLED;
+	rs485.flags |= (config->rs485_rts_on_send) ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND;
+	rs485.delay_rts_before_send = config->rs485_delay_before;
+	rs485.delay_rts_after_send = config->rs485_delay_after;
+	return(ioctl(serio->fd, TIOCSRS485, &rs485));
+#else
+	errno = ENOTSUP;
+	return(-1);
+#endif
+}
+
 /* 
  * Open the serial device. 
  *
@@ -49,14 +156,14 @@
  * port programming howto.
  */
 
-serioStuff *serio_open(char *tty_name, unsigned baudrate) {
+serioStuff *serio_open(char *tty_name, unsigned baudrate, serioConfig *config) {
 	struct termios termios;
 	serioStuff *serio;
-	speed_t brc;
-	
+
 
 	if((serio = malloc(sizeof(serioStuff))) == NULL)
 		return NULL;
+	serio->rxhead = serio->rxtail = 0;
 
 	/* 
 	 * Open the serio tty device.
@@ -93,43 +200,96 @@ serioStuff *serio_open(char *tty_name, unsigned baudrate) {
 	termios.c_oflag &= ~(OPOST | ONLCR | OCRNL | ONLRET | OFILL);
 	termios.c_iflag &= ~(ICRNL | IXON | IXOFF | IMAXBEL);
 	
-	switch(baudrate){
-		case 9600:
-			brc = B9600;
-			break;
-
-		case 57600:
-			brc = B57600;
-			break;
-
-		default:
-			return NULL;
+	/* Save our modified settings back to the tty. */
+	if(tcsetattr(serio->fd, TCSANOW, &termios) != 0) {
+		return NULL;
 	}
 
-
 	/* Set the speed of the port. */
-	if(cfsetospeed(&termios, brc) != 0) {
+	if(serio_set_baud(serio, baudrate)) {
 		return NULL;
 	}
-	if(cfsetispeed(&termios, brc) != 0) {
-		return NULL;
+	
+	/* USB adapters hold received bytes back for a while unless told not to. */
+	if(config && config->low_latency) {
+		serio_low_latency(serio, tty_name, config->latency_timer);
 	}
 	
-	/* Save our modified settings back to the tty. */
-	if(tcsetattr(serio->fd, TCSANOW, &termios) != 0) {
-		return NULL;
+	/* The port must do RS-485 if it was asked for, or nothing will get onto the bus. */
+	if(config && config->rs485) {
+		if(serio_rs485(serio, config)) {
+			return NULL;
+		}
 	}
 	
 	return(serio);
 }
 
+/*
+ * Set the baud rate. Waits for any pending output to be sent at the old rate first.
+ *
+ * Standard rates are set with cfsetospeed()/cfsetispeed(). Others need the termios2 ioctls.
+ * Returns 0 if successful, else -1.
+ */
+
+int serio_set_baud(serioStuff *serio, unsigned baudrate)
+{
+	struct termios termios;
+	int i;
+#ifdef SERIO_TERMIOS2
+	struct termios2 termios2;
+#endif
+
+	tcdrain(serio->fd);
+
+	for(i = 0; baudrates[i].baudrate; i++){
+		if(baudrates[i].baudrate == baudrate)
+			break;
+	}
+
+	if(baudrates[i].baudrate){
+		if(tcgetattr(serio->fd, &termios) != 0)
+			return -1;
+		if(cfsetospeed(&termios, baudrates[i].brc) != 0)
+			return -1;
+		if(cfsetispeed(&termios, baudrates[i].brc) != 0)
+			return -1;
+		if(tcsetattr(serio->fd, TCSANOW, &termios) != 0)
+			return -1;
+		return 0;
+	}
+
+#ifdef SERIO_TERMIOS2
+	if(ioctl(serio->fd, TCGETS2, &termios2) != 0)
+		return -1;
+	termios2.c_cflag &= ~CBAUD;
+	termios2.c_cflag |= BOTHER;
+	termios2.c_ospeed = baudrate;
+	termios2.c_ispeed = baudrate;
+	if(ioctl(serio->fd, TCSETS2, &termios2) != 0)
+		return -1;
+	return 0;
+#else
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
 /* Flush the input buffer */
 
 int serio_flush_input(serioStuff *serio)
 {
+	serio->rxtail = serio->rxhead;
 	return tcflush(serio->fd, TCIFLUSH);
 }
 
+/* Wait until everything written has been sent */
+
+int serio_drain(serioStuff *serio)
+{
+	return tcdrain(serio->fd);
+}
+
 
 
 /* Close the TTY port, and free the serio structure */
@@ -139,35 +299,25 @@ void serio_close(serioStuff *serio){
 	free(serio);
 }
 
-/* 
- * Wait for the serio hardware to provide us with some data.
- *
- * This function should only be called when we know the serio should have sent
- * us something.  We don't wait long in here, if it isn't screwed up, it
- * should be sending quite quickly.  We return true if we got a byte and
- * false if we timed out waiting for one.
+/*
+ * Wait for the tty to be ready for events, up to the deadline.
+ * Returns 1 if it is, 0 on a time out, or -1 on an error.
  */
-int serio_wait_read(serioStuff *serio, int rx_timeout) {
-	fd_set read_fd_set;
-	struct timeval tv;
+static int serio_poll(serioStuff *serio, short events, struct timespec *deadline) {
+	struct pollfd pfd;
 	int retval;
 	
-	/* Wait for data to be readable. */
 	for(;;) {
+		pfd.fd = serio->fd;
+		pfd.events = events;
+		pfd.revents = 0;
+		retval = poll(&pfd, 1, deadline_ms(deadline));
 		
-		/* Make the call to select to wait for reading. */
-		FD_ZERO(&read_fd_set);
-		FD_SET(serio->fd, &read_fd_set);
-		tv.tv_sec=0;
-		tv.tv_usec=rx_timeout;
-		retval=select(serio->fd+1, &read_fd_set, NULL, NULL, &tv);
-		
-		/* Did select error? */
+		/* Did poll error? */
 		if(retval == -1) {
 			
 			/* If it's an EINTR, go try again. */
 			if(errno == EINTR) {
-//			debug(DEBUG_EXPECTED, "Signal recieved in read select, restarting.");
 				continue;
 			}
 			
@@ -175,20 +325,26 @@ int serio_wait_read(serioStuff *serio, int rx_timeout) {
 			return(-1);
 		}
 		
-		/* Was data available? */
-		if(retval) {	
-			
-			/* We got some data, return ok. */
-			return(1);
-		}
-		
-		/* No data available. */
-		else {
-			
-			/* We didn't get any data. This is a time out */
-			return(0);
-		}
+		/* Ready, or a time out. Errors and hangups show up in the read or write which follows. */
+		return(retval ? 1 : 0);
+	}
+}
+
+/* 
+ * Wait for some data to read, either already in the receive buffer or from
+ * the serio hardware.  We return true if there is a byte to read and false
+ * if the deadline passed waiting for one.
+ */
+
+int serio_wait_read(serioStuff *serio, struct timespec *deadline) {
+	
+	/* Bytes buffered by an earlier read don't show up in a poll. */
+	if(serio->rxhead != serio->rxtail) {
+		return(1);
 	}
+	
+	/* Wait for data to be readable. */
+	return(serio_poll(serio, POLLIN, deadline));
 }
 
 
@@ -196,77 +352,85 @@ int serio_wait_read(serioStuff *serio, int rx_timeout) {
  * Wait for the serio hardware to be writable.
  */
 
-int serio_wait_write(serioStuff *serio, int tx_timeout) {
-	fd_set write_fd_set;
-	struct timeval tv;
-	int retval;
+int serio_wait_write(serioStuff *serio, struct timespec *deadline) {
 	
 	/* Wait for data to be writable. */
+	return(serio_poll(serio, POLLOUT, deadline));
+}
+
+
+/*
+ * Refill the receive ring buffer with whatever the tty has, in one read.
+ * Returns the number of bytes added, 0 on a time out, or -1 on an error.
+ */
+static int serio_fill(serioStuff *serio, struct timespec *deadline) {
+	unsigned in = serio->rxhead & (SERIO_RXBUF - 1);
+	size_t room = SERIO_RXBUF - (serio->rxhead - serio->rxtail);
+	ssize_t retval;
+	int res;
+	
+	/* Only read into the contiguous part of the free space. */
+	if(room > SERIO_RXBUF - in)
+		room = SERIO_RXBUF - in;
+	
 	for(;;) {
 		
-		/* Make the call to select to wait for writing. */
-		FD_ZERO(&write_fd_set);
-		FD_SET(serio->fd, &write_fd_set);
-		tv.tv_sec=0;
-		tv.tv_usec=tx_timeout;
-		retval=select(serio->fd+1, NULL, &write_fd_set, NULL, &tv);
+		/* Wait for data to be available. */
+		if((res = serio_poll(serio, POLLIN, deadline)) <= 0) {
+			return(res);
+		}
 		
-		/* Did select error? */
-		if(retval == -1) {
-			
-			/* If it's an EINTR, go try again. */
-			if(errno == EINTR) {
-				continue;
-			}
-			
-			/* It was something weird. */
-			return(-1); 
+		/* Take everything the tty has. */
+		retval=read(serio->fd, serio->rxbuf + in, room);
+		if(retval > 0) {
+			serio->rxhead += retval;
+			return(retval);
 		}
 		
-		/* Can we write data? */
-		if(retval) {	
-			
-			/* We can write some data, return ok. */
-			return(1);
+		/* End of file means the tty went away. */
+		if(!retval) {
+			errno = EIO;
+			return(-1);
 		}
 		
-		/* No data writable. */
-		else {
-			
-			/* We can't write any data. this is a time out. */
-			return(0);
+		/* Readable but nothing there, go wait again. */
+		if((errno != EAGAIN) && (errno != EINTR)) {
+			return(-1);
 		}
 	}
 }
 
-
 /* 
  * Read data from the serio hardware.
  *
- * Basically works like read(), but with a select-provided readable check
- * and timeout.
+ * Basically works like read(), but with a poll-provided readable check
+ * and an absolute deadline for the whole read.
  * 
  * Returns the number of bytes read.  This might be less than what was given
  * if we ran out of time.
  */
-int serio_read(serioStuff *serio, void *buf, size_t count, int rx_timeout) {
+
+int serio_read(serioStuff *serio, void *buf, size_t count, struct timespec *deadline) {
 	int bytes_read;
-	ssize_t retval;
+	int retval;
 	
 	/* Read the request into the buffer. */
 	for(bytes_read=0; bytes_read < count;) {
 		
-		/* Wait for data to be available. */
-		if(!serio_wait_read(serio, rx_timeout)) {
-			return(bytes_read);
+		/* Refill the ring if it is empty. */
+		if(serio->rxhead == serio->rxtail) {
+			if((retval = serio_fill(serio, deadline)) < 0) {
+				return(-1);
+			}
+			if(!retval) {
+				return(bytes_read);
+			}
 		}
 		
-		/* Get as much of it as we can.  Loop for the rest. */
-		retval=read(serio->fd, (char *) buf + bytes_read, count - bytes_read);
-		if(retval == -1) {
-			return -1;
+		/* Take as much as we need from the ring.  Loop for the rest. */
+		while((bytes_read < count) && (serio->rxtail != serio->rxhead)) {
+			((unsigned char *) buf)[bytes_read++] = serio->rxbuf[serio->rxtail++ & (SERIO_RXBUF - 1)];
 		}
-		bytes_read += retval;
 	}
 	
 	/* We're all done. */
@@ -277,13 +441,13 @@ int serio_read(serioStuff *serio, void *buf, size_t count, int rx_timeout) {
 /* 
  * Write data to the serio hardware.
  *
- * Basically works like write(), but with a select-provided writeable check
- * and timeout.
+ * Basically works like write(), but with a poll-provided writeable check
+ * and an absolute deadline for the whole write.
  * 
  * Returns the number of bytes written.  This might be less than what was
  * given if we ran out of time.
  */
-int serio_write(serioStuff *serio, void *buf, size_t count, int tx_timeout) {
+int serio_write(serioStuff *serio, void *buf, size_t count, struct timespec *deadline) {
 	int bytes_written;
 	ssize_t retval;
 	
@@ -291,7 +455,7 @@ int serio_write(serioStuff *serio, void *buf, size_t count, int tx_timeout) {
 	for(bytes_written=0; bytes_written < count;) {
 		
 		/* Wait for data to be writeable. */
-		if(!serio_wait_write(serio, tx_timeout)) {
+		if(!serio_poll(serio, POLLOUT, deadline)) {
 //			debug(DEBUG_UNEXPECTED, "Gave up waiting for serio to be writeable.");
 			return(bytes_written);
 		}
@@ -24,6 +24,7 @@
 
 #include <time.h>
 #include <unistd.h>
+#include "deadline.h"
 
 /* The maximum time to wait for an expected byte to be readable. */
 #define SERIO_WAIT_READ_USEC_DELAY 5000000
@@ -31,23 +32,54 @@
 /* The maximum time to wait to be able to write to the x10 hardware. */
 #define SERIO_WAIT_WRITE_USEC_DELAY 5000000
 
+/* Size of the receive ring buffer, must be a power of 2. */
+#define SERIO_RXBUF 512
+
 /* Typedefs. */
 typedef struct seriostuff serioStuff;
+typedef struct serioconfig serioConfig;
+
+/* Port settings for serio_open(). */
+struct serioconfig {
+	
+	/* Ask the driver to pass received bytes on right away. */
+	int low_latency;
+	
+	/* Latency timer of a USB adapter in ms, set in low latency mode where sysfs has one. */
+	int latency_timer;
+	
+	/* Have the kernel drive RTS as the RS-485 transmit enable. */
+	int rs485;
+	
+	/* RTS is high while sending if set, else low. */
+	int rs485_rts_on_send;
+	
+	/* Delays in ms between RTS and the first bit, and between the last bit and RTS. */
+	int rs485_delay_before;
+	int rs485_delay_after;
+};
 
 /* Structure to hold serio info. */
 struct seriostuff {
 	
 	/* File descriptor to the serio tty. */
 	int fd;
+
+	/* Receive ring buffer. Bytes are added at rxhead as they are read from the tty, and taken from rxtail. */
+	unsigned char rxbuf[SERIO_RXBUF];
+	unsigned rxhead;
+	unsigned rxtail;
 };
 
 /* Prototypes. */
-serioStuff *serio_open(char *tty_name, unsigned baudrate);
+serioStuff *serio_open(char *tty_name, unsigned baudrate, serioConfig *config);
+int serio_set_baud(serioStuff *serio, unsigned baudrate);
 void serio_close(serioStuff *hanio);
 int serio_flush_input(serioStuff *serio);
-int serio_wait_read(serioStuff *hanio, int rx_timeout);
-int serio_wait_write(serioStuff *hanio, int tx_timeout);
-int serio_read(serioStuff *hanio, void *buf, size_t count, int rx_timeout);
-int serio_write(serioStuff *hanio, void *buf, size_t count, int tx_timeout);
+int serio_drain(serioStuff *serio);
+int serio_wait_read(serioStuff *hanio, struct timespec *deadline);
+int serio_wait_write(serioStuff *hanio, struct timespec *deadline);
+int serio_read(serioStuff *hanio, void *buf, size_t count, struct timespec *deadline);
+int serio_write(serioStuff *hanio, void *buf, size_t count, struct timespec *deadline);
 
 #endif
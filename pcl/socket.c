@@ -40,6 +40,7 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/fcntl.h>
+#include <poll.h>
 #include "error.h"
 #include "socket.h"
 
@@ -285,10 +286,10 @@ int socket_connect_ip(char *host, char *service, int family, int socktype) {
 /*
  * Read from a socket.
  *
- * The socket must be non-blocking, or the timeout is useless.  We return
+ * The socket must be non-blocking, or the deadline is useless.  We return
  * true if we worked, and false if we timed out.
  */
-int socket_read(int socket, void *buffer, int size, int timeout) {
+int socket_read(int socket, void *buffer, int size, struct timespec *deadline) {
 	int received;
 	int readval;
 	
@@ -296,15 +297,15 @@ int socket_read(int socket, void *buffer, int size, int timeout) {
 	for(received=0; received < size;) {
 		
 		/* Wait until data becomes available. */
-		if(!socket_wait_read(socket, timeout)) {
-			debug(DEBUG_ACTION, "Socket read timed out.");
+		if(!socket_wait_read(socket, deadline)) {
+			debug(DEBUG_ACTION, "Socket read deadline passed.");
 			return(0);
 		}
 		
 		/* Read as much as we can. */
 		readval=read(socket, ((char *) buffer) + received, size - received);
 
-		if(readval == EINTR)
+		if((readval == -1) && (errno == EINTR))
 			continue;
 
 		if(readval <= 0) {
@@ -324,11 +325,11 @@ int socket_read(int socket, void *buffer, int size, int timeout) {
 /*
  * Read a line of text from a socket.
  *
- * The socket must be non-blocking, or the timeout is useless.  We return
+ * The socket must be non-blocking, or the deadline is useless.  We return
  * number of bytes received if successfull, 0 if we timed out, or the socket was closed on us,
  * or negative if an error occured.
  */
-int socket_read_line(int socket, char *buffer, int size, int timeout) {
+int socket_read_line(int socket, char *buffer, int size, struct timespec *deadline) {
 	int received;
 	int readval;
 	char lf, ret;
@@ -337,15 +338,15 @@ int socket_read_line(int socket, char *buffer, int size, int timeout) {
 	for(received=0, lf = 0, ret = 0; received < size;) {
 		
 		/* Wait until data becomes available. */
-		if(!socket_wait_read(socket, timeout)) {
-			debug(DEBUG_ACTION, "Socket read timed out.");
+		if(!socket_wait_read(socket, deadline)) {
+			debug(DEBUG_ACTION, "Socket read deadline passed.");
 			return(received);
 		}
 		
 		/* Read as much as we can. */
 		readval=read(socket, ((char *) buffer) + received, 1);
 
-		if(readval == EINTR)
+		if((readval == -1) && (errno == EINTR))
 			continue;
 
 		if(readval != 1) {
@@ -383,10 +384,10 @@ int socket_read_line(int socket, char *buffer, int size, int timeout) {
 /*
  * Write to a socket.
  *
- * The socket must be non-blocking, or the timeout is useless.  We return
+ * The socket must be non-blocking, or the deadline is useless.  We return
  * true if we worked, and false if we timed out.
  */
-int socket_write(int socket, void *buffer, int size, int timeout) {
+int socket_write(int socket, void *buffer, int size, struct timespec *deadline) {
 	int sent;
 	int writeval;
 	
@@ -394,8 +395,8 @@ int socket_write(int socket, void *buffer, int size, int timeout) {
 	for(sent=0; sent < size;) {
 		
 		/* Wait until data becomes available. */
-		if(!socket_wait_write(socket, timeout)) {
-			debug(DEBUG_ACTION, "Socket write timed out.");
+		if(!socket_wait_write(socket, deadline)) {
+			debug(DEBUG_ACTION, "Socket write deadline passed.");
 			return(0);
 		}
 		
@@ -418,30 +419,24 @@ int socket_write(int socket, void *buffer, int size, int timeout) {
 /* 
  * Wait for a socket to become readable.
  *
- * If it didn't become readable in the ammount of time given, return false,
+ * If it didn't become readable by the deadline, return false,
  * otherwise true.
  *
- * The timeout given is in milliseconds.  If it is -1, it is infinite.
+ * The deadline is an absolute CLOCK_MONOTONIC time.  If it is NULL, we wait forever.
  */
-int socket_wait_read(int socket, int timeout) {
-	fd_set read_fd_set;
-	struct timeval tv;
-	struct timeval *tvp;
+int socket_wait_read(int socket, struct timespec *deadline) {
+	struct pollfd pfd;
+	int retval;
 	
-	/* If the timeout is -1, we have no timeout. */
-	if(timeout == -1) {
-		tvp=NULL;
-	}
-	else {
-		tvp=&tv;
-	}
+	/* Wait for data to be readable, going back to waiting if a signal comes in. */
+	do {
+		pfd.fd=socket;
+		pfd.events=POLLIN;
+		pfd.revents=0;
+		retval=poll(&pfd, 1, deadline_ms(deadline));
+	} while((retval == -1) && (errno == EINTR));
 	
-	/* Wait for data to be readable. */
-	FD_ZERO(&read_fd_set);
-	FD_SET(socket, &read_fd_set);
-	tv.tv_sec=0;
-	tv.tv_usec=timeout;
-	if(select(socket+1, &read_fd_set, NULL, NULL, tvp)) {
+	if(retval > 0) {
 		
 		/* We got some data, return ok. */
 		return(1);
@@ -457,31 +452,25 @@ int socket_wait_read(int socket, int timeout) {
 /* 
  * Wait for a socket to become writable.
  *
- * If it didn't become writable in the ammount of time given, return false,
+ * If it didn't become writable by the deadline, return false,
  * otherwise true.
  *
- * The timeout given is in milliseconds.  If it is -1, it is infinite.
+ * The deadline is an absolute CLOCK_MONOTONIC time.  If it is NULL, we wait forever.
  */
  
-int socket_wait_write(int socket, int timeout) {
-	fd_set write_fd_set;
-	struct timeval tv;
-	struct timeval *tvp;
+int socket_wait_write(int socket, struct timespec *deadline) {
+	struct pollfd pfd;
+	int retval;
 	
-	/* If the timeout is -1, we have no timeout. */
-	if(timeout == -1) {
-		tvp=NULL;
-	}
-	else {
-		tvp=&tv;
-	}
+	/* Wait for the socket to be writable, going back to waiting if a signal comes in. */
+	do {
+		pfd.fd=socket;
+		pfd.events=POLLOUT;
+		pfd.revents=0;
+		retval=poll(&pfd, 1, deadline_ms(deadline));
+	} while((retval == -1) && (errno == EINTR));
 	
-	/* Wait for data to be readable. */
-	FD_ZERO(&write_fd_set);
-	FD_SET(socket, &write_fd_set);
-	tv.tv_sec=0;
-	tv.tv_usec=timeout;
-	if(select(socket+1, NULL, &write_fd_set, NULL, tvp)) {
+	if(retval > 0) {
 		
 		/* We got the go ahead to write, return ok. */
 		return(1);
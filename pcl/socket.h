@@ -24,6 +24,8 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include "deadline.h"
+
 
 /* Prototypes. */
 void socket_close(int socket);
@@ -31,10 +33,10 @@ int socket_create(char *socket_name, int mode, int uid, int gid);
 int socket_create_listen(char *bindaddr, char *service, int protovers, int socktype, int (*addsock)(int sock, void *addr, int family, int socktype));
 int socket_connect(char *socket_name);
 int socket_connect_ip(char *host, char *service, int family, int socktype);
-int socket_read(int socket, void *buffer, int size, int timeout);
-int socket_read_line(int socket, char *line, int maxbuffer, int timeout);
-int socket_write(int socket, void *buffer, int size, int timeout);
-int socket_wait_read(int socket, int timeout);
-int socket_wait_write(int socket, int timeout);
+int socket_read(int socket, void *buffer, int size, struct timespec *deadline);
+int socket_read_line(int socket, char *line, int maxbuffer, struct timespec *deadline);
+int socket_write(int socket, void *buffer, int size, struct timespec *deadline);
+int socket_wait_read(int socket, struct timespec *deadline);
+int socket_wait_write(int socket, struct timespec *deadline);
 
 #endif
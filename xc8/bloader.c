@@ -7,6 +7,18 @@
 //#define FORCE_ERR			// Test error recovery
 #define	WITH_LED			// Allow LED usage
 #define WITH_BUTTON			// Allow button usage
+#define WITH_WINDOW			// Allow windowed writes (uses WINDOW_ROWS * ROW_BYTES of RAM)
+#define WITH_ERASE			// Allow range erase of program memory
+#define WITH_ROW_CRC			// Allow reading back row CRCs
+#define WITH_CHECK_CRC			// Allow checking the app CRC against the one the PC expects
+#define WITH_RLE			// Allow run length coded row writes
+#define WITH_COPY			// Allow copying rows already on the target
+#define WITH_PACK			// Allow 14 bit packed row writes
+#define WITH_COMPOUND			// Allow commands which save a round trip
+#define WITH_FEC			// Allow forward error correction on packets from the PC
+#define WITH_INTERLEAVE			// Allow programming several nodes at once (needs WITH_WINDOW)
+#define WITH_BROADCAST			// Allow writes broadcast to every node of this product
+#define WITH_BAUD			// Allow the PC to switch to a faster baud rate (uses timer 1)
 
 
 /* Oscillator frequency */
@@ -23,9 +35,19 @@
 // Set these to indicate different versions and protocol changes to the PC loader app (pcl).
 #define PRODUCTID	0x3FFF			// Product ID (unique for each product). Do not use the default 0x3FFF as that is reserved for testing.
 #define BOOTVERSION	0			// Boot loader version (change when additional functionallity is added to boot loader, and pcl needs to know about it)
-#define PROTOCOL	0			// Protocol in use (change when boot loader expects a deviation in the protocol different from what
+#define PROTOCOL	5			// Protocol in use (change when boot loader expects a deviation in the protocol different from what
 						// is documented here and pcl needs to know about it)
 #define LOADER_SIZE	0x800			// Loader size in words
+#define WINDOW_ROWS	4			// Number of rows buffered in windowed write mode
+#define PACKET_ROWS	2			// Max rows in one write packet
+#ifdef WITH_FEC
+#define FEC_WAYS	4			// Interleaved FEC codewords per packet, one byte error can be corrected in each
+#define FEC_BYTES	(FEC_WAYS * 2)		// FEC check bytes after the CRC
+#else
+#define FEC_BYTES	0
+#endif
+#define NUM_BAUDS	5			// Number of baud rates in baud_list
+#define BAUD_TIMEOUT	16			// Timer 1 overflows (65.5ms each) to wait for a valid packet after a baud rate change
 
 #define	TXENA		LATCbits.LATC3		// RS-485 Transmit enable
 #ifdef WITH_LED
@@ -61,10 +83,29 @@
 
 #define BC_QUERY	0x00			// Query command
 #define BC_CHECK_APP	0x08			// Check app space for integrity
+#define BC_CHECK_CRC	0x09			// Check app space for integrity, and that the app CRC matches param
+#define BC_ROW_CRC	0x0A			// Return the CRCs of a range of program memory rows
+#define BC_POLL		0x0B			// Return a cumulative ACK for the packets committed so far
 #define BC_WRITE_EN	0x10			// Write enable
+#define BC_SET_BAUD	0x11			// Switch to the baud rate at index param in the baud rate list
+#define BC_SET_ADDRU	0x12			// Set bits 16-23 of the word address of the commands which follow
+#define BC_ERASE_PM	0x20			// Erase a range of program memory rows
+#define BC_COPY_PM	0x21			// Copy program memory rows on the target
 #define BC_WRITE_PM	0x40			// Write program memory
+#define BC_WRITE_PMW	0x41			// Write program memory, windowed, no response
+#define BC_WRITE_PMWA	0x42			// Write program memory, windowed, commit rows and send cumulative ACK
+#define BC_WRITE_PMZ	0x43			// Write program memory, run length coded rows
+#define BC_WRITE_PMP	0x44			// BC_WRITE_PM with 14 bit packed rows
+#define BC_WRITE_PMWP	0x45			// BC_WRITE_PMW with 14 bit packed rows
+#define BC_WRITE_PMWPA	0x46			// BC_WRITE_PMWA with 14 bit packed rows
+#define BC_WRITE_PMC	0x47			// BC_WRITE_PM, then BC_CHECK_APP
+#define BC_WRITE_PMWC	0x48			// BC_WRITE_PMWA without the response
+#define BC_WRITE_PMWPC	0x49			// BC_WRITE_PMWC with 14 bit packed rows
+#define BC_WRITE_PMB	0x4A			// Write program memory on every node of the product ID in seq, no response
+#define BC_WRITE_PMBP	0x4B			// BC_WRITE_PMB with 14 bit packed rows
 #define BC_WRITE_EEPROM	0xA5			// Write config memory
 #define BC_EXEC_APP	0x55			// Execute APP
+#define BC_CHECK_EXEC	0x56			// BC_CHECK_APP, then BC_EXEC_APP if good
 #define BC_RESET	0xAA			// Reset CPU
 
 
@@ -75,19 +116,62 @@
 #define STX 		0x02
 #define ETX		0x03
 #define SUBST		0x04
+#define ENQ		0x05
+#define SO		0x0E
 #define	HDC		0xFF	
+#define	HDS		0xFE			// Short packet type
+#define	HDCF		0xFD			// Full packet with FEC check bytes
+#define	HDSF		0xFC			// Short packet with FEC check bytes
+#define BROADCAST_ADDR	0xFF			// Address of broadcast writes, no node has it as an erased EEPROM gives 0x1F
 #define ACK		0xC1
 #define NAK 		0x81
 
 #define MAX_CF          32
 
+// Capability flags in the query response
+
+#define CAP_ERASE	0x01			// BC_ERASE_PM supported
+#define CAP_ROW_CRC	0x02			// BC_ROW_CRC supported
+#define CAP_CHECK_CRC	0x04			// BC_CHECK_CRC supported
+#define CAP_RLE		0x08			// BC_WRITE_PMZ supported
+#define CAP_COPY	0x10			// BC_COPY_PM supported
+#define CAP_BAUD	0x20			// BC_SET_BAUD supported
+#define CAP_PACK	0x40			// BC_WRITE_PMP, BC_WRITE_PMWP and BC_WRITE_PMWPA supported
+#define CAP_COMPOUND	0x80			// QO_WRITE_EN, BC_WRITE_PMC and BC_CHECK_EXEC supported
+
+// More capability flags, in caps2
+#define CAP2_FEC	0x01			// Packets from the PC may carry FEC check bytes
+#define CAP2_INTERLEAVE	0x02			// BC_WRITE_PMWC, BC_WRITE_PMWPC and BC_POLL supported
+#define CAP2_BROADCAST	0x04			// BC_WRITE_PMB and BC_WRITE_PMBP supported
+#define CAP2_ADDRU	0x08			// BC_SET_ADDRU supported, and appsizeu reported
+
+#define QUERY_OPTS	0xA500			// High byte of a BC_QUERY param which carries option bits in the low byte
+#define QO_WRITE_EN	0x01			// Also enable writes (CAP_COMPOUND)
+#define QO_NAK_REASON	0x02			// Follow each NAK with a reason code and the expected sequence number
+
+// NAK reason codes
+#define NR_CRC		0x01			// Bad CRC
+#define NR_LENGTH	0x02			// Bad packet length
+#define NR_SEQ		0x03			// Sequence number is not the one expected
+#define NR_WRITE_EN	0x04			// Writes not enabled
+#define NR_RANGE	0x05			// Address, count or payload out of range
+#define NR_CMD		0x06			// Unknown command
+
+#define MAX_BAUDS	8			// Size of the baud rate list in the query response
+
+#define RLE_RUN		0x80			// Token is a run of one word
+#define PACKED_ROW	((ROW_BYTES >> 3) * 7)	// Bytes in a 14 bit packed row, 4 words in 7 bytes
+#define PACKET_OVERHEAD	(sizeof(ps_t) - ROW_BYTES) // Header, pad and CRC bytes in a packet
+#define SHORT_LEN	7			// Offset of the payload length in a short packet
+#define SHORT_OVERHEAD	10			// Header, length and CRC bytes in a short packet
+
 #define POLY16          0x1021
 
 
 
 /* Macros */
 
-#define SET_BAUD(B) (((_XTAL_FREQ/B)/64) - 1)
+#define BRG16(B100) (((_XTAL_FREQ/4)/((B100) * 100UL)) - 1)	// 16 bit baud rate generator value, BRGH set, rate in units of 100 baud
 
 /*
  * Structs
@@ -117,6 +201,14 @@ typedef struct {
 	uint8_t  bootvers;
 	uint8_t  proto;
 	uint8_t  config[MAX_CF];
+	uint8_t  window;
+	uint8_t  caps;
+	uint16_t bauds[MAX_BAUDS];
+	uint8_t  rowwords;
+	uint8_t  maxrows;
+	uint16_t eesize;
+	uint8_t  caps2;
+	uint8_t  appsizeu;			// Bits 16-23 of appsize, always 0 as these parts have less than 64K words
 } response_t;
 
 typedef union	{
@@ -138,7 +230,7 @@ typedef struct {
 } ps_t;
 
 typedef union {
-	uint8_t buffer[sizeof(ps_t)];
+	uint8_t buffer[sizeof(ps_t) + ((PACKET_ROWS - 1) * ROW_BYTES) + FEC_BYTES];
 	ps_t s;
 } packet_t;
 
@@ -150,6 +242,27 @@ typedef union {
 
 packet_t pkt;
 static uint8_t cmd, myaddress;
+static uint16_t seqno;
+static bit cobs;				// Last packet was COBS framed
+static bit shortpkt;				// Last packet was a short packet
+static bit naks;				// Send NAK reason codes
+static uint8_t nakreason;			// Reason for the last NAK
+static uint8_t rowbuf[ROW_BYTES];		// Scratch buffer for one row of program memory
+
+#ifdef WITH_WINDOW
+static uint8_t wbuf[WINDOW_ROWS][ROW_BYTES];	// Rows received in the current window
+static uint16_t waddr[WINDOW_ROWS];		// Word addresses of the above
+static uint8_t wcount;				// Number of rows in the window
+static uint8_t wpkts;				// Number of packets in the window
+#endif
+
+#ifdef WITH_BAUD
+// Baud rates offered to the PC in units of 100 baud. The first one is the power up rate.
+static const uint16_t baud_list[NUM_BAUDS] = {96, 576, 1152, 2500, 5000};
+static const uint16_t brg_list[NUM_BAUDS] = {BRG16(96), BRG16(576), BRG16(1152), BRG16(2500), BRG16(5000)};
+static uint8_t newbaud;				// Baud rate index + 1 to switch to once the ACK has been sent
+static uint8_t baud_ticks;			// Timer 1 overflows left before falling back to the power up rate
+#endif
 
 /*
 * CODE
@@ -243,24 +356,90 @@ static void putc(uint8_t c)
     TXREG = c;
 }
 
+/*
+ * Load the baud rate generator
+ */
+
+static void set_brg(uint16_t brg)
+{
+    SPBRGH = (uint8_t) (brg >> 8);
+    SPBRGL = (uint8_t) brg;
+}
+
 /*
  * Wait for a character to be received, then return it
+ *
+ * After a baud rate change, fall back to the power up rate if no valid packet arrives in time.
  */
 
 static uint8_t getc(void)
 {
-    while(FALSE == PIR1bits.RCIF)
+    while(FALSE == PIR1bits.RCIF){
         if(RCSTAbits.OERR){
             RCSTAbits.SPEN = FALSE;
             NOP();
             RCSTAbits.SPEN = TRUE;
         }
+        #ifdef WITH_BAUD
+        if(baud_ticks && PIR1bits.TMR1IF){
+            PIR1bits.TMR1IF = FALSE;
+            if(!--baud_ticks)
+                set_brg(brg_list[0]);
+        }
+        #endif
+    }
 
     return RCREG;
 
 }
 
 
+/* Calculate the CRC for the packet buffer and send it */
+
+static void send_packet(uint8_t plen)
+{
+	uint8_t i, n, len;
+	uint16_t crc16;
+
+	len = sizeof(ps_t);
+	if(shortpkt){ // Reply with a short packet if the PC sent one
+		for(i = plen; i; i--) // Make room for the length
+			pkt.buffer[SHORT_LEN + i] = pkt.buffer[SHORT_LEN + i - 1];
+		pkt.s.pkttype = HDS;
+		pkt.buffer[SHORT_LEN] = plen;
+		len = SHORT_OVERHEAD + plen;
+	}
+	crc16 = calc_crc16(0, pkt.buffer, len - sizeof(uint16_t));
+	pkt.buffer[len - 2] = (uint8_t) crc16;
+	pkt.buffer[len - 1] = (uint8_t)(crc16 >> 8);
+
+	if(cobs){ // Reply in the framing the PC used
+		putc(NUL);
+		for(i = 0;;){
+			for(n = i; (n != len) && (pkt.buffer[n]); n++)
+				;
+			putc(n - i + 1);
+			for(; i != n; i++)
+				putc(pkt.buffer[i]);
+			if(n == len)
+				break;
+			i++; // Zero implied by the code byte
+		}
+		putc(NUL);
+		return;
+	}
+
+	putc(STX);
+	// Send packet
+	for( i = 0 ; i != len ; i++){
+		if(pkt.buffer[i] <= SUBST)
+			putc(SUBST);
+		putc(pkt.buffer[i]);
+	}
+	putc(ETX);
+}
+
+
 /* Send query response packet */
 
 static void send_query_response(void)
@@ -269,7 +448,7 @@ static void send_query_response(void)
 	uint8_t i;
 	uint16_t v;
 
-	for(i = 0; i != sizeof(packet_t); i++) // Zero out packet buffer
+	for(i = 0; i != sizeof(ps_t); i++) // Zero out packet buffer
 		pkt.buffer[i] = 0;
 
 	// Build the response packet
@@ -278,23 +457,152 @@ static void send_query_response(void)
 	pkt.s.pl.resp.prodid = PRODUCTID;
 	pkt.s.pl.resp.bootvers = BOOTVERSION;
 	pkt.s.pl.resp.proto = PROTOCOL;
+	pkt.s.pl.resp.rowwords = ROW_WORDS;
+	pkt.s.pl.resp.maxrows = PACKET_ROWS;
+	pkt.s.pl.resp.eesize = _EEPROMSIZE;
+	#ifdef WITH_WINDOW
+	pkt.s.pl.resp.window = WINDOW_ROWS;
+	#endif
+	#ifdef WITH_ERASE
+	pkt.s.pl.resp.caps |= CAP_ERASE;
+	#endif
+	#ifdef WITH_ROW_CRC
+	pkt.s.pl.resp.caps |= CAP_ROW_CRC;
+	#endif
+	#ifdef WITH_CHECK_CRC
+	pkt.s.pl.resp.caps |= CAP_CHECK_CRC;
+	#endif
+	#ifdef WITH_RLE
+	pkt.s.pl.resp.caps |= CAP_RLE;
+	#endif
+	#ifdef WITH_COPY
+	pkt.s.pl.resp.caps |= CAP_COPY;
+	#endif
+	#ifdef WITH_PACK
+	pkt.s.pl.resp.caps |= CAP_PACK;
+	#endif
+	#ifdef WITH_COMPOUND
+	pkt.s.pl.resp.caps |= CAP_COMPOUND;
+	#endif
+	#ifdef WITH_FEC
+	pkt.s.pl.resp.caps2 |= CAP2_FEC;
+	#endif
+	#ifdef WITH_INTERLEAVE
+	pkt.s.pl.resp.caps2 |= CAP2_INTERLEAVE;
+	#endif
+	#ifdef WITH_BROADCAST
+	pkt.s.pl.resp.caps2 |= CAP2_BROADCAST;
+	#endif
+	pkt.s.pl.resp.caps2 |= CAP2_ADDRU;
+	#ifdef WITH_BAUD
+	pkt.s.pl.resp.caps |= CAP_BAUD;
+	for(i = 0 ; i != NUM_BAUDS ; i++)
+		pkt.s.pl.resp.bauds[i] = baud_list[i];
+	#endif
 	for(i = 0, q = &pkt.s.pl.resp.config ; i != CONFIG_BLOCK_SIZE ; i++){
 		v = read_configmem_word(i);
 		*q++ = (uint8_t) v;
 		*q++ = (uint8_t)(v >> 8);
 	}
-	// Calculate CRC for above
-	pkt.s.crc16 = calc_crc16(0, pkt.buffer, sizeof(packet_t) - sizeof(uint16_t));
+	send_packet(sizeof(response_t));
+}
 
-	putc(STX);
-	// Send packet
-	for( i = 0 ; i != sizeof(packet_t) ; i++){
-		if(pkt.buffer[i] <= SUBST)
-			putc(SUBST);
-		putc(pkt.buffer[i]);
+#ifdef WITH_ROW_CRC
+
+/* Send a packet with the CRCs of the rows requested with BC_ROW_CRC */
+
+static void send_row_crcs(void)
+{
+	uint8_t i, count;
+	uint16_t pmaddr, crc16;
+
+	pmaddr = pkt.s.param;
+	count = pkt.s.pl.payload[0];
+
+	for(i = 0; i != sizeof(ps_t); i++) // Zero out packet buffer
+		pkt.buffer[i] = 0;
+
+	pkt.s.cmd = BC_ROW_CRC;
+	pkt.s.param = pmaddr;
+	for(i = 0; i != count; i++){
+		flash_read_row(pmaddr, rowbuf);
+		crc16 = calc_crc16(0, rowbuf, ROW_BYTES);
+		pkt.s.pl.payload[i << 1] = (uint8_t) crc16;
+		pkt.s.pl.payload[(i << 1) + 1] = (uint8_t) (crc16 >> 8);
+		pmaddr += ROW_WORDS;
 	}
-	putc(ETX);
+	send_packet(count << 1);
+}
+#endif
+
+
+#ifdef WITH_RLE
+
+/*
+ * Expand the run length coded rows in the payload of a BC_WRITE_PMZ packet.
+ * With program clear the stream is only checked. Returns 1 if the stream is bad.
+ */
+
+static uint8_t expand_rows(uint16_t pmaddr, uint8_t nrows, uint8_t program)
+{
+	uint8_t i, w, t, count;
+
+	w = 0;
+	for(i = 1; nrows; ){ // Row count is in payload[0]
+		if(i >= ROW_BYTES)
+			return 1; // Stream too short
+		t = pkt.s.pl.payload[i++];
+		for(count = (t & ~RLE_RUN) + 1; count; count--){
+			if((!nrows) || (i > ROW_BYTES - 2))
+				return 1; // Too many words, or stream too short
+			rowbuf[w++] = pkt.s.pl.payload[i];
+			rowbuf[w++] = pkt.s.pl.payload[i + 1];
+			if(!(t & RLE_RUN))
+				i += 2;
+			if(w == ROW_BYTES){
+				if(program)
+					flash_write_row(pmaddr, rowbuf);
+				pmaddr += ROW_WORDS;
+				w = 0;
+				nrows--;
+				CLRWDT();
+			}
+		}
+		if(t & RLE_RUN)
+			i += 2;
+	}
+	return 0;
+}
+#endif
+
+
+#ifdef WITH_COPY
+
+/*
+ * Copy the rows in the payload of a BC_COPY_PM packet.
+ * With program clear the address pairs are only checked. Returns 1 if an address is bad.
+ */
+
+static uint8_t copy_rows(uint8_t count, uint8_t program)
+{
+	uint8_t i;
+	uint16_t dst, src;
+
+	for(i = 0; i != (uint8_t) (count << 2); i += 4){
+		dst = pkt.s.pl.payload[i] | ((uint16_t) pkt.s.pl.payload[i + 1] << 8);
+		src = pkt.s.pl.payload[i + 2] | ((uint16_t) pkt.s.pl.payload[i + 3] << 8);
+		if((dst < APP_START) || (dst >= _ROMSIZE) || (dst & (ROW_WORDS - 1)) ||
+		(src < APP_START) || (src > _ROMSIZE - ROW_WORDS))
+			return 1;
+		if(program){
+			flash_read_words(src, rowbuf);
+			flash_write_row(dst, rowbuf);
+			CLRWDT();
+		}
+	}
+	return 0;
 }
+#endif
 
 
 /* Test app in ROM for integrity */
@@ -327,37 +635,202 @@ static uint8_t check_appspace(void)
 
 }
 
+#ifdef WITH_CHECK_CRC
+/* Return the app CRC stored in the top row */
+
+static uint16_t app_crc(void)
+{
+	flash_read_row((_ROMSIZE - ROW_WORDS) , &pkt.s.pl); // Read the top row
+	return (((uint16_t) pkt.s.pl.i.crchi << 8)) | pkt.s.pl.i.crclo;
+}
+#endif
+
 
-/* Process received packet */
+/*
+ * Return row j of the packet payload. Packed rows are unpacked into rowbuf first,
+ * every 7 bytes holding 4 words, least significant bits first.
+ */
 
-static uint8_t process_packet(void)
+static uint8_t *packet_row(uint8_t j, uint8_t packed)
 {
-	uint8_t i;
+	uint8_t i, *p, *q;
+
+	#ifdef WITH_PACK
+	if(packed){
+		p = pkt.s.pl.payload + (j * PACKED_ROW);
+		for(i = 0, q = rowbuf; i != (ROW_BYTES >> 3); i++, p += 7, q += 8){
+			q[0] = p[0];
+			q[1] = p[1] & 0x3F;
+			q[2] = (uint8_t)((p[1] >> 6) | (p[2] << 2));
+			q[3] = ((p[2] >> 6) | (p[3] << 2)) & 0x3F;
+			q[4] = (uint8_t)((p[3] >> 4) | (p[4] << 4));
+			q[5] = ((p[4] >> 4) | (p[5] << 4)) & 0x3F;
+			q[6] = (uint8_t)((p[5] >> 2) | (p[6] << 6));
+			q[7] = p[6] >> 2;
+		}
+		return rowbuf;
+	}
+	#endif
+	return pkt.s.pl.payload + (j * ROW_BYTES);
+}
+
+#ifdef WITH_FEC
+/* Multiply by x in GF(256), polynomial 0x11D */
+
+static uint8_t gf_xtime(uint8_t x)
+{
+	if(x & 0x80)
+		return (uint8_t)(x << 1) ^ 0x1D;
+	return (uint8_t)(x << 1);
+}
+
+/*
+ * Correct the first len bytes of the packet from the FEC check bytes which follow them.
+ * Byte i of the packet is in codeword w = i % FEC_WAYS, which starts with check bytes 2w and 2w + 1.
+ * One bad byte can be put right in each codeword, anything worse is left for the CRC check to catch.
+ */
+
+static void fec_correct(uint8_t len)
+{
+	uint8_t w, i, j, n, s0, s1, t;
+	uint8_t *p;
+
+	for(w = 0, p = pkt.buffer + len; w != FEC_WAYS; w++, p += 2){
+		// Syndromes, s1 by Horner's rule from the last byte of the codeword down
+		n = (uint8_t)((len - w + FEC_WAYS - 1) / FEC_WAYS);
+		s0 = 0;
+		s1 = 0;
+		for(i = n, j = (uint8_t)(w + ((n - 1) * FEC_WAYS)); i; i--, j -= FEC_WAYS){
+			s0 ^= pkt.buffer[j];
+			s1 = gf_xtime(s1) ^ pkt.buffer[j];
+		}
+		s0 ^= p[0] ^ p[1];
+		s1 = gf_xtime(gf_xtime(s1) ^ p[1]) ^ p[0];
+		if((!s0) || (!s1))
+			continue; // Good, or more than one error
+		// A single error of s0 at codeword position i gives s1 = s0 * x^i
+		for(i = 0, t = s0; i != (n + 2); i++, t = gf_xtime(t)){
+			if(t == s1){
+				if(i >= 2)
+					pkt.buffer[w + ((i - 2) * FEC_WAYS)] ^= s0;
+				break;
+			}
+		}
+	}
+}
+#endif
+
+/*
+ * NAK a packet which could not be processed, if the PC asked for reasons.
+ * Windowed writes which do not end a window with a cumulative ACK get no response, so the bus stays free for the rest of the window.
+ * Broadcast writes get none either, as every node of the product would answer at once.
+ */
+
+static uint8_t nak_bad(uint8_t reason)
+{
+	if((!naks) || (BC_WRITE_PMW == pkt.s.cmd) || (BC_WRITE_PMWP == pkt.s.cmd) ||
+	(BC_WRITE_PMWC == pkt.s.cmd) || (BC_WRITE_PMWPC == pkt.s.cmd) || (BC_WRITE_PMB == pkt.s.cmd) ||
+	(BC_WRITE_PMBP == pkt.s.cmd))
+		return NUL;
+	nakreason = reason;
+	return NAK;
+}
+
+/* Process received packet, len is the number of bytes received */
+
+static uint8_t process_packet(uint8_t len)
+{
+	uint8_t i, j;
+	uint8_t prows, rowbytes, plen;
+	uint8_t *row;
 	uint8_t acknak;
 	uint8_t eeaddress;
 	uint16_t crc16;
-	static uint16_t seqno,pseq;
+	static uint16_t pseq;
 	uint16_t param;
+	uint16_t nrows;
 	static bit write_en;
+	static bit packed;
+	#ifdef WITH_FEC
+	static bit fecpkt;
+	#endif
 
 	#ifdef FORCE_ERR
 	static int errctr; 
 	#endif
 
 	// check packet
-	crc16 = calc_crc16(0, pkt.buffer, sizeof(packet_t) - sizeof(uint16_t));
-	if(crc16 != pkt.s.crc16){
+	if(len < SHORT_OVERHEAD)
+		return NUL; // runt, ignore
+	#ifdef WITH_FEC
+	// The packet type says whether FEC check bytes follow the CRC
+	fecpkt = (((HDCF == pkt.s.pkttype) || (HDSF == pkt.s.pkttype)) && (len >= (SHORT_OVERHEAD + FEC_BYTES)));
+	if(fecpkt){
+		len -= FEC_BYTES;
+		fec_correct(len);
+	}
+	#endif
+	crc16 = calc_crc16(0, pkt.buffer, len - sizeof(uint16_t));
+	if(crc16 != (((uint16_t) pkt.buffer[len - 1] << 8) | pkt.buffer[len - 2])){
+		// Only answer if the header still looks like it is for us, other nodes share the bus
+		if(((HDC == pkt.s.pkttype) || (HDS == pkt.s.pkttype) || (HDCF == pkt.s.pkttype) || (HDSF == pkt.s.pkttype)) &&
+		(pkt.s.address == myaddress))
+			return nak_bad(NR_CRC);
 		return NUL; // no good, ignore
 	}
 
 
 	// check packet type
-	if(pkt.s.pkttype != HDC)
+	#ifdef WITH_FEC
+	if(fecpkt) // From here on it is handled like the packet without check bytes
+		pkt.s.pkttype = (HDCF == pkt.s.pkttype) ? HDC : HDS;
+	#endif
+	shortpkt = (HDS == pkt.s.pkttype);
+	if((pkt.s.pkttype != HDC) && (!shortpkt))
 		return NUL; // wrong packet type, ignore
 
 	// check packet address
+	#ifdef WITH_BROADCAST
+	// Broadcast writes are for every node of the product, whose ID they carry in place of the sequence number
+	if((pkt.s.address != myaddress) && ((pkt.s.address != BROADCAST_ADDR) || (pkt.s.seq != PRODUCTID) ||
+	((pkt.s.cmd != BC_WRITE_PMB) && (pkt.s.cmd != BC_WRITE_PMBP))))
+		return NUL; // not for us, ignore
+	#else
 	if(pkt.s.address != myaddress)
 		return NUL; // not for us, ignore
+	#endif
+
+	// Get the payload length. A short packet carries it. Its payload is moved to where it sits in a full packet,
+	// and zero filled to a whole row. A full packet is padded to a whole number of rows.
+	if(shortpkt){
+		plen = pkt.buffer[SHORT_LEN];
+		if(len != (SHORT_OVERHEAD + plen))
+			return nak_bad(NR_LENGTH); // bad length
+		for(i = 0; i != plen; i++)
+			pkt.buffer[SHORT_LEN + i] = pkt.buffer[SHORT_LEN + 1 + i];
+		for(; i < ROW_BYTES; i++)
+			pkt.buffer[SHORT_LEN + i] = 0;
+	}
+	else if(len >= PACKET_OVERHEAD)
+		plen = len - PACKET_OVERHEAD;
+	else
+		return nak_bad(NR_LENGTH); // runt
+
+	// One row, or up to PACKET_ROWS whole rows, packed rows are shorter
+	packed = 0;
+	#ifdef WITH_PACK
+	packed = ((pkt.s.cmd == BC_WRITE_PMP) || (pkt.s.cmd == BC_WRITE_PMWP) || (pkt.s.cmd == BC_WRITE_PMWPA) ||
+	(pkt.s.cmd == BC_WRITE_PMWPC) || (pkt.s.cmd == BC_WRITE_PMBP));
+	#endif
+	rowbytes = (packed) ? PACKED_ROW : ROW_BYTES;
+	prows = 1;
+	if(plen > rowbytes){
+		prows = (uint8_t)(plen / rowbytes);
+		if((prows > PACKET_ROWS) || (plen != (prows * rowbytes)))
+			return nak_bad(NR_LENGTH); // bad length
+	}
+	else if((plen != rowbytes) && (!shortpkt))
+		return nak_bad(NR_LENGTH); // full packets carry whole rows
 
 
 	pseq = pkt.s.seq;
@@ -365,10 +838,29 @@ static uint8_t process_packet(void)
 	cmd = pkt.s.cmd;
 	acknak = ACK;
 
+	// Reason for a NAK from the write commands, which check these first
+	if(!write_en)
+		nakreason = NR_WRITE_EN;
+	else if(seqno != pseq)
+		nakreason = NR_SEQ;
+	else
+		nakreason = NR_RANGE;
+
+	#ifdef WITH_BAUD
+	baud_ticks = 0; // Valid packet, keep the current baud rate
+	#endif
+
 	switch(cmd){
 		case	BC_QUERY:
 			seqno = 0; // Zero out sequence number when we get this command. This provides a way to sync.
 			write_en = 0;
+			naks = 0;
+			if(QUERY_OPTS == (param & 0xFF00)){ // Options from the PC
+				naks = (param & QO_NAK_REASON) ? 1 : 0;
+				#ifdef WITH_COMPOUND
+				write_en = (param & QO_WRITE_EN) ? 1 : 0; // Query and write enable in one round trip
+				#endif
+			}
 			#ifdef FORCE_ERR
 			errctr = 11; // Force an error on the tenth block. 
 			#endif
@@ -379,7 +871,31 @@ static uint8_t process_packet(void)
 			write_en = 1;
 			break;
 
+		#ifdef WITH_BAUD
+		case	BC_SET_BAUD: // Switch baud rate once the ACK has been sent
+			if(param < NUM_BAUDS)
+				newbaud = (uint8_t) param + 1;
+			else{
+				acknak = NAK;
+				nakreason = NR_RANGE;
+			}
+			break;
+		#endif
+
+		case	BC_SET_ADDRU: // Program memory ends below 64K words, so only the first 64K words can be selected
+			if(param){
+				acknak = NAK;
+				nakreason = NR_RANGE;
+			}
+			break;
+
 		case	BC_WRITE_PM:
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMP:
+		#endif
+		#ifdef WITH_COMPOUND
+		case	BC_WRITE_PMC:
+		#endif
 
 			#ifdef FORCE_ERR
 			if(1 == errctr){ // Force an error
@@ -393,17 +909,127 @@ static uint8_t process_packet(void)
 			#endif
 
 			if((write_en) && (seqno == pseq) && (param >= APP_START)){
-				flash_write_row(param, pkt.s.pl.payload);
+				for(j = 0; j != prows; j++){
+					flash_write_row(param, packet_row(j, packed));
+					param += ROW_WORDS;
+				}
 			}
 			else
 				acknak = NAK;
+			#ifdef WITH_COMPOUND
+			if((BC_WRITE_PMC == cmd) && (ACK == acknak) && check_appspace())
+				acknak = STX; // Row written, but the app does not check out
+			#endif
 			break;
 
-		case	BC_WRITE_EEPROM: // Write EEPROM in 64 byte chunks
+		#ifdef WITH_RLE
+		case	BC_WRITE_PMZ: // Write the number of rows in the first payload byte, starting at param
+			nrows = pkt.s.pl.payload[0];
+			if((write_en) && (seqno == pseq) && (param >= APP_START) && (param < _ROMSIZE) && (nrows) &&
+			(nrows <= ((_ROMSIZE - param) / ROW_WORDS)) && (!expand_rows(param, (uint8_t) nrows, 0))){
+				expand_rows(param, (uint8_t) nrows, 1);
+			}
+			else
+				acknak = NAK;
+			break;
+		#endif
+
+		#ifdef WITH_COPY
+		case	BC_COPY_PM: // Copy rows, param is the number of address pairs in the payload
+			if((write_en) && (seqno == pseq) && (param) && (param <= (ROW_BYTES >> 2)) && (!copy_rows((uint8_t) param, 0))){
+				copy_rows((uint8_t) param, 1);
+			}
+			else
+				acknak = NAK;
+			break;
+		#endif
+
+		#ifdef WITH_ERASE
+		case	BC_ERASE_PM: // Erase the number of rows in the first payload word, starting at param
+			nrows = ((uint16_t) pkt.s.pl.payload[1] << 8) | pkt.s.pl.payload[0];
+			if((write_en) && (seqno == pseq) && (param >= APP_START) && (param < _ROMSIZE) &&
+			(nrows <= ((_ROMSIZE - param) / ROW_WORDS))){
+				for(; nrows; nrows--){
+					flash_erase_row(param);
+					param += ROW_WORDS;
+					CLRWDT();
+				}
+			}
+			else
+				acknak = NAK;
+			break;
+		#endif
+
+		#ifdef WITH_WINDOW
+		case	BC_WRITE_PMW:
+		case	BC_WRITE_PMWA:
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMWP:
+		case	BC_WRITE_PMWPA:
+		#endif
+		#ifdef WITH_INTERLEAVE
+		case	BC_WRITE_PMWC:
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMWPC:
+		#endif
+		#endif
+			if(seqno == pseq)
+				wcount = wpkts = 0; // Window (re)started at the last committed packet, drop anything left over
+			if((write_en) && ((uint16_t)(seqno + wpkts) == pseq) && (param >= APP_START) && ((wcount + prows) <= WINDOW_ROWS)){
+				for(j = 0; j != prows; j++){
+					row = packet_row(j, packed);
+					for(i = 0; i != ROW_BYTES; i++)
+						wbuf[wcount][i] = row[i];
+					waddr[wcount++] = param;
+					param += ROW_WORDS;
+				}
+				wpkts++;
+			}
+			if((BC_WRITE_PMW == cmd) || (BC_WRITE_PMWP == cmd)){
+				acknak = NUL; // No response until the end of the window
+				break;
+			}
+			// End of window, program the rows received in sequence
+			for(i = 0; i != wcount; i++)
+				flash_write_row(waddr[i], wbuf[i]);
+			seqno += wpkts;
+			wcount = wpkts = 0;
+			acknak = ENQ; // Cumulative ACK
+			#ifdef WITH_INTERLEAVE
+			if((BC_WRITE_PMWC == cmd) || (BC_WRITE_PMWPC == cmd))
+				acknak = NUL; // The PC polls for the cumulative ACK once the bus is free
+			#endif
+			break;
+
+		#ifdef WITH_INTERLEAVE
+		case	BC_POLL:
+			acknak = ENQ; // Cumulative ACK for the packets committed so far
+			break;
+		#endif
+		#endif
+
+		#ifdef WITH_BROADCAST
+		case	BC_WRITE_PMB: // Sent to every node of the product, the sequence number is left alone
+		#ifdef WITH_PACK
+		case	BC_WRITE_PMBP:
+		#endif
+			if((write_en) && (param >= APP_START)){
+				for(j = 0; j != prows; j++){
+					flash_write_row(param, packet_row(j, packed));
+					param += ROW_WORDS;
+				}
+			}
+			acknak = NUL; // The PC checks the rows of each node afterwards
+			break;
+		#endif
+
+		case	BC_WRITE_EEPROM: // Write EEPROM in 64 byte chunks, param is the byte address
 			if(write_en && (seqno == pseq)){
 				eeaddress = ((uint8_t) param);
-                                for(i = 0; i != ROW_BYTES; i++)
-                                    eeprom_write(eeaddress+i, pkt.s.pl.payload[i]);
+				for(j = 0, row = pkt.s.pl.payload; j != prows; j++, row += ROW_BYTES){
+					for(i = 0; i != ROW_BYTES; i++)
+						eeprom_write(eeaddress++, row[i]);
+				}
 			}
 			else
 				acknak = NAK;
@@ -416,6 +1042,41 @@ static uint8_t process_packet(void)
 				acknak = ACK; // Good
 			break;
 
+		#ifdef WITH_CHECK_CRC
+		case	BC_CHECK_CRC:
+			if(check_appspace() || (app_crc() != param))
+				acknak = STX; // Bad, or not the image the PC expects
+			else
+				acknak = ACK; // Good
+			break;
+		#endif
+
+		#ifdef WITH_COMPOUND
+		case	BC_CHECK_EXEC:
+			if(check_appspace())
+				acknak = STX; // Bad, stay in the loader
+			else
+				acknak = ETX; // Good, execute
+			break;
+		#endif
+
+		#ifdef WITH_ROW_CRC
+		case	BC_ROW_CRC: // Return CRCs of the rows starting at param, number of rows in the first payload byte
+			if((param >= APP_START) && (param < _ROMSIZE)){
+				nrows = (_ROMSIZE - param) / ROW_WORDS;
+				if(pkt.s.pl.payload[0] > (ROW_BYTES >> 1))
+					pkt.s.pl.payload[0] = (ROW_BYTES >> 1);
+				if(pkt.s.pl.payload[0] > nrows)
+					pkt.s.pl.payload[0] = (uint8_t) nrows;
+				acknak = SO;
+			}
+			else{
+				acknak = NAK;
+				nakreason = NR_RANGE;
+			}
+			break;
+		#endif
+
 		case	BC_RESET:
 		case	BC_EXEC_APP:
 			acknak = ETX;
@@ -423,6 +1084,7 @@ static uint8_t process_packet(void)
 
 		default:
 			acknak = NAK;
+			nakreason = NR_CMD;
 			break;
 	}
 	if(acknak == ACK){
@@ -437,29 +1099,69 @@ static void do_bootloader(void)
 {
 	uint8_t c;
 	uint8_t i;
+	uint8_t n, code;
+
+	#ifdef WITH_BAUD
+	T1CON = 0x31; // Fosc/4, 1:8 prescale, on
+	#endif
 
 	for(;;){
 		c = getc();
-		// wait for STX;
-		if(c != STX)
+		// wait for STX or a COBS frame delimiter
+		if((STX != c) && (NUL != c))
 			continue;
 
+		cobs = (NUL == c);
 
 		// Get packet bytes
 
-		for(i = 0;;){
-			c = getc();
-			if(ETX == c)
-				break;
-			if(SUBST == c)
+		if(cobs){
+			// Put the zeros back as the code bytes arrive
+			for(i = 0, n = 0, code = 0xFF;;){
+				c = getc();
+				if(NUL == c){
+					if(i || n)
+						break;
+					code = 0xFF; // Nothing since the last delimiter, so this one starts the frame
+					continue;
+				}
+				if(n){
+					n--;
+				}
+				else{
+					if((0xFF != code) && (i < sizeof(pkt)))
+						pkt.buffer[i++] = NUL;
+					code = c;
+					n = c - 1;
+					continue;
+				}
+				if(i < sizeof(pkt))
+					pkt.buffer[i++] = c;
+			}
+			if(n)
+				i = 0; // Truncated, ignore
+		}
+		else{
+			for(i = 0;;){
 				c = getc();
-			if(i < sizeof(pkt))
-				pkt.buffer[i++] = c;
+				if(ETX == c)
+					break;
+				if(NUL == c){
+					i = 0; // Always escaped, so we started on an STX in a COBS frame. Ignore it.
+					break;
+				}
+				if(SUBST == c)
+					c = getc();
+				if(i < sizeof(pkt))
+					pkt.buffer[i++] = c;
+			}
 		}
 
 		/* Process packet */
 
-		i = process_packet();
+		i = process_packet(i);
+		if(NUL == i)
+			continue; // No response, leave the bus alone
 
                 /* Send a response */
 
@@ -473,10 +1175,24 @@ static void do_bootloader(void)
 				putc(STX);
 				break;
 
+			#ifdef WITH_WINDOW
+			case	ENQ: // Cumulative ACK carrying the sequence number of the last row committed
+				putc(ACK);
+				putc((uint8_t) (seqno - 1));
+				putc((uint8_t) ((uint16_t)(seqno - 1) >> 8));
+				break;
+			#endif
+
 			case	SOH:
 				send_query_response();
 				break;
 
+			#ifdef WITH_ROW_CRC
+			case	SO:
+				send_row_crcs();
+				break;
+			#endif
+
 			case	ETX:
 				putc(ACK);
                                 tx_wait_empty();
@@ -493,6 +1209,11 @@ static void do_bootloader(void)
 	
 			case	NAK:
 				putc(NAK);
+				if(naks){ // Reason, and the sequence number expected next
+					putc(nakreason);
+					putc((uint8_t) seqno);
+					putc((uint8_t) (seqno >> 8));
+				}
 				break;
 			
 			default:
@@ -502,6 +1223,17 @@ static void do_bootloader(void)
 		tx_wait_empty();
                 TXENA = FALSE;
 
+		#ifdef WITH_BAUD
+		if(newbaud){ // ACK has gone out at the old rate, switch now
+			set_brg(brg_list[newbaud - 1]);
+			newbaud = 0;
+			TMR1H = 0;
+			TMR1L = 0;
+			PIR1bits.TMR1IF = FALSE;
+			baud_ticks = BAUD_TIMEOUT;
+		}
+		#endif
+
 	}
 }
 
@@ -525,10 +1257,11 @@ int main(void)
     PORTC = 0x00;
     
 
-    /* UART */
-    SPBRGL = SET_BAUD(9600);
+    /* UART, 9600 baud */
+    BAUDCONbits.BRG16 = TRUE;
+    set_brg(BRG16(96));
     RCSTA = 0x10;
-    TXSTA = 0x20;
+    TXSTA = 0x24;
     RCSTAbits.SPEN = TRUE;
 
     /* Get RS-485 address */
@@ -16,16 +16,16 @@
 
 /*
  *
- * Read a row from program memory
+ * Read a row's worth of words from program memory, starting at any word address
  *
  */
 
 
 
-void flash_read_row(uint16_t pm_word_addr, void *buffer)
+void flash_read_words(uint16_t pm_word_addr, void *buffer)
 {
     uint16_t *pma = (uint16_t *) buffer;
-    uint16_t wa = pm_word_addr & ~(ROW_WORDS - 1); //force row boundary
+    uint16_t wa = pm_word_addr;
     uint16_t i;
     EECON1bits.CFGS = FALSE;
     EECON1bits.EEPGD = TRUE;
@@ -43,23 +43,30 @@ void flash_read_row(uint16_t pm_word_addr, void *buffer)
 
 }
 
+/*
+ *
+ * Read a row from program memory
+ *
+ */
+
+void flash_read_row(uint16_t pm_word_addr, void *buffer)
+{
+    flash_read_words(pm_word_addr & ~(ROW_WORDS - 1), buffer); //force row boundary
+}
+
 
 /*
- * Write a row to program memory
- * 
+ * Erase a row of program memory
+ *
  *
  * Must be called with interrupts disabled!
  *
  */
 
-void flash_write_row(uint16_t pm_word_addr, void *buffer)
+void flash_erase_row(uint16_t pm_word_addr)
 {
-    uint16_t *b = (uint16_t *) buffer;
     uint16_t wa = pm_word_addr & ~(ROW_WORDS - 1); //force row boundary
-    uint16_t v;
-    uint8_t i,j;
 
-    /* Erase row */
     EEADRL = (uint8_t) wa;
     EEADRH = (uint8_t) (wa >> 8);
 
@@ -75,6 +82,28 @@ void flash_write_row(uint16_t pm_word_addr, void *buffer)
     NOP();
     NOP();
     EECON1bits.FREE = FALSE;
+    EECON1bits.WREN = FALSE;
+}
+
+
+/*
+ * Write a row to program memory
+ * 
+ *
+ * Must be called with interrupts disabled!
+ *
+ */
+
+void flash_write_row(uint16_t pm_word_addr, void *buffer)
+{
+    uint16_t *b = (uint16_t *) buffer;
+    uint16_t v;
+    uint8_t i,j;
+
+    /* Erase row, leaves the row address in EEADR */
+    flash_erase_row(pm_word_addr);
+
+    EECON1bits.WREN = TRUE;
 
     // Write loop
     
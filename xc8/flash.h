@@ -18,7 +18,9 @@
 extern "C" {
 #endif
 
+void flash_read_words(uint16_t pm_word_addr, void *buffer);
 void flash_read_row(uint16_t pm_word_addr, void *buffer);
+void flash_erase_row(uint16_t pm_word_addr);
 void flash_write_row(uint16_t pm_word_addr, void *buffer);
 
 